@@ -0,0 +1,192 @@
+//
+// 基准测试的公共部分: 计时, 延迟分位数, 启动线程, 以JSON输出结果
+//
+// 每个基准程序输出一个JSON对象, 第一个参数为输出文件, 缺省输出到标准输出:
+// {"bench": "chan", "results": [{"name": "mpmc", "producers": 4, "ops_per_sec": 1.2e6, "p99_ns": 850}, ...]}
+//
+
+#ifndef SMP_BENCH_H
+#define SMP_BENCH_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <pthread.h>
+
+namespace bench {
+	inline uint64_t now() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	// 防止被测的计算被优化掉
+	template <typename T>
+	inline void keep(const T& v) {
+		__asm__ __volatile__("" : : "g"(&v) : "memory");
+	}
+
+	// 延迟样本, 取分位数时排序
+	class Lat {
+	public:
+		Lat(): sorted(true) {
+		}
+
+		void add(uint64_t ns) {
+			v.push_back(ns);
+			sorted = false;
+		}
+
+		void merge(const Lat& l) {
+			v.insert(v.end(), l.v.begin(), l.v.end());
+			sorted = false;
+		}
+
+		size_t count() const {
+			return v.size();
+		}
+
+		// p为0到1之间的分位
+		double pct(double p) {
+			if (v.empty())
+				return 0;
+
+			if (!sorted) {
+				std::sort(v.begin(), v.end());
+				sorted = true;
+			}
+
+			size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+			return (double)v[i];
+		}
+
+	private:
+		std::vector<uint64_t> v;
+		bool sorted;
+	};
+
+	class Result {
+	public:
+		Result(const char* name): name(name) {
+		}
+
+		Result& set(const char* key, double value) {
+			keys.push_back(key);
+			values.push_back(value);
+			return *this;
+		}
+
+		// 吞吐量和每次操作的耗时
+		Result& rate(uint64_t ops, uint64_t ns) {
+			set("ops", (double)ops);
+			set("ns_per_op", ops > 0 ? (double)ns / ops : 0);
+			return set("ops_per_sec", ns > 0 ? ops * 1e9 / ns : 0);
+		}
+
+		Result& lat(Lat& l) {
+			set("p50_ns", l.pct(0.50));
+			set("p99_ns", l.pct(0.99));
+			return set("p999_ns", l.pct(0.999));
+		}
+
+		void write(FILE* f) const {
+			fprintf(f, "{\"name\": \"%s\"", name.c_str());
+			for (size_t i = 0; i < keys.size(); i++)
+				fprintf(f, ", \"%s\": %.6g", keys[i].c_str(), values[i]);
+			fprintf(f, "}");
+		}
+
+	private:
+		std::string name;
+		std::vector<std::string> keys;
+		std::vector<double> values;
+	};
+
+	class Report {
+	public:
+		Report(const char* bench): bench(bench) {
+		}
+
+		Result& add(const char* name) {
+			results.push_back(Result(name));
+			return results.back();
+		}
+
+		// 进度输出到标准错误, 结果输出到argv[1]或标准输出
+		int write(int argc, char* argv[]) const {
+			FILE* f = argc > 1 ? fopen(argv[1], "w") : stdout;
+			if (f == NULL) {
+				perror(argv[1]);
+				return 1;
+			}
+
+			fprintf(f, "{\"bench\": \"%s\", \"results\": [\n", bench.c_str());
+			for (size_t i = 0; i < results.size(); i++) {
+				fprintf(f, "\t");
+				results[i].write(f);
+				fprintf(f, i + 1 < results.size() ? ",\n" : "\n");
+			}
+			fprintf(f, "]}\n");
+
+			if (f != stdout)
+				fclose(f);
+
+			return 0;
+		}
+
+	private:
+		std::string bench;
+		std::vector<Result> results;
+	};
+
+	// 启动n个线程运行fn(args[i]), 全部结束后返回总耗时(纳秒)
+	// 线程之间用barrier同时开始
+	struct Start {
+		pthread_barrier_t*	barrier;
+		void*			(*fn)(void*);
+		void*			arg;
+	};
+
+	inline void* started(void* p) {
+		Start* s = (Start*)p;
+		pthread_barrier_wait(s->barrier);
+		return s->fn(s->arg);
+	}
+
+	template <typename T>
+	uint64_t parallel(void* (*fn)(void*), std::vector<T>& args) {
+		size_t n = args.size();
+		std::vector<Start> st(n);
+		std::vector<pthread_t> tids(n);
+		pthread_barrier_t barrier;
+
+		pthread_barrier_init(&barrier, NULL, (unsigned)n + 1);
+		for (size_t i = 0; i < n; i++) {
+			st[i].fn = fn;
+			st[i].arg = &args[i];
+			st[i].barrier = &barrier;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			if (pthread_create(&tids[i], NULL, started, &st[i]) != 0) {
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+
+		pthread_barrier_wait(&barrier);
+		uint64_t b = now();
+		for (size_t i = 0; i < n; i++)
+			pthread_join(tids[i], NULL);
+		uint64_t e = now();
+
+		pthread_barrier_destroy(&barrier);
+		return e - b;
+	}
+}
+
+#endif
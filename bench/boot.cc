@@ -0,0 +1,97 @@
+//
+// Boot: 启动耗时. 每个单例的创建模拟1ms的I/O等待, 比较依赖链、宽依赖图在不同线程数下的总耗时,
+// 以及创建本身可以忽略时每个单例的调度开销
+//
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+
+#include "bench.h"
+#include "../boot.h"
+
+namespace {
+	const size_t Nodes = 64;
+	const size_t Width = 8;			// 分层图每层的单例数
+
+	void io() {
+		usleep(1000);
+	}
+
+	void nop() {
+	}
+
+	// chain: 每个单例依赖前一个; layered: 每层依赖上一层的全部单例; flat: 无依赖
+	std::string deps(const char* shape, size_t i) {
+		char b[16];
+		std::string d;
+
+		if (strcmp(shape, "chain") == 0 && i > 0) {
+			snprintf(b, sizeof(b), "n%lu", (unsigned long)(i - 1));
+			d = b;
+		} else if (strcmp(shape, "layered") == 0 && i >= Width) {
+			size_t first = (i / Width - 1) * Width;
+			for (size_t k = first; k < first + Width; k++) {
+				snprintf(b, sizeof(b), "%sn%lu", d.empty() ? "" : ",", (unsigned long)k);
+				d += b;
+			}
+		}
+
+		return d;
+	}
+
+	// 返回start()的耗时, 同时累计各单例的创建耗时
+	uint64_t boot(const char* shape, void (*init)(), size_t threads, uint64_t& work) {
+		smp::Boot b;
+		char name[16];
+
+		for (size_t i = 0; i < Nodes; i++) {
+			snprintf(name, sizeof(name), "n%lu", (unsigned long)i);
+			b.add(name, deps(shape, i).c_str(), init, NULL);
+		}
+
+		uint64_t t = bench::now();
+		if (b.start(threads) != 0) {
+			fprintf(stderr, "boot %s: %s\n", shape, b.error().c_str());
+			exit(1);
+		}
+		t = bench::now() - t;
+
+		work = 0;
+		for (size_t i = 0; i < Nodes; i++) {
+			snprintf(name, sizeof(name), "n%lu", (unsigned long)i);
+			work += (uint64_t)b.timing(name);
+		}
+
+		b.stop();
+		return t;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("boot");
+	const char* shapes[] = {"chain", "layered", "flat"};
+	const size_t threads[] = {1, 4, 8};
+
+	for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+		for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+			uint64_t work;
+			uint64_t ns = boot(shapes[s], io, threads[t], work);
+
+			// speedup: 各单例创建耗时之和与总耗时之比
+			rep.add(shapes[s])
+				.set("threads", (double)threads[t])
+				.set("nodes", Nodes)
+				.set("total_ms", ns / 1e6)
+				.set("speedup", ns > 0 ? (double)work / ns : 0);
+		}
+	}
+
+	for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		uint64_t work;
+		uint64_t ns = boot("layered", nop, threads[t], work);
+		rep.add("overhead").set("threads", (double)threads[t]).set("nodes", Nodes).rate(Nodes, ns);
+	}
+
+	return rep.write(argc, argv);
+}
@@ -0,0 +1,133 @@
+//
+// Bufs: 小块追加组装消息、切片拷贝、共享拷贝和聚集写的开销, 以std::string为对照
+// 多线程的追加测量共享块池的争用
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+#include "bench.h"
+#include "../bufs.h"
+
+namespace {
+	typedef smp::Bufs<4096> Buf;
+
+	const size_t Rounds = 20000;
+	const size_t Piece = 100;
+	const size_t Msg = 64 << 10;		// 每轮组装的消息长度
+
+	char piece[Piece];
+
+	struct Arg {
+		size_t n;
+	};
+
+	void* append(void* p) {
+		Arg* a = (Arg*)p;
+		Buf b;
+		for (size_t i = 0; i < a->n; i++) {
+			for (size_t k = 0; k < Msg / Piece; k++)
+				b.append(piece, Piece);
+			bench::keep(b.size());
+			b.clear();
+		}
+		return NULL;
+	}
+
+	void* concat(void* p) {
+		Arg* a = (Arg*)p;
+		std::string s;
+		for (size_t i = 0; i < a->n; i++) {
+			for (size_t k = 0; k < Msg / Piece; k++)
+				s.append(piece, Piece);
+			bench::keep(s.size());
+			s.clear();
+		}
+		return NULL;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("bufs");
+	const int threads[] = {1, 4};
+	memset(piece, 'x', sizeof(piece));
+
+	for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		std::vector<Arg> args(threads[t]);
+		for (int i = 0; i < threads[t]; i++)
+			args[i].n = Rounds / 10 / threads[t];
+
+		size_t ops = args[0].n * threads[t] * (Msg / Piece);
+		uint64_t ns = bench::parallel(append, args);
+		rep.add("append").set("threads", threads[t]).set("piece", Piece).rate(ops, ns);
+
+		ns = bench::parallel(concat, args);
+		rep.add("string_append").set("threads", threads[t]).set("piece", Piece).rate(ops, ns);
+	}
+
+	Buf msg;
+	std::string str;
+	for (size_t k = 0; k < Msg / Piece; k++) {
+		msg.append(piece, Piece);
+		str.append(piece, Piece);
+	}
+
+	{
+		// 跨块的切片再拷贝出来
+		char out[1000];
+		uint64_t b = bench::now();
+		for (size_t i = 0; i < Rounds; i++) {
+			Buf s = msg.slice((i * 4093) % (Msg - sizeof(out)), sizeof(out));
+			bench::keep(s.copy(out, 0, sizeof(out)));
+		}
+		uint64_t ns = bench::now() - b;
+		rep.add("slice_copy").set("bytes", sizeof(out)).rate(Rounds, ns);
+	}
+
+	{
+		// 拷贝只增加引用计数, 对照std::string的深拷贝
+		uint64_t b = bench::now();
+		for (size_t i = 0; i < Rounds; i++) {
+			Buf c(msg);
+			bench::keep(c.size());
+		}
+		uint64_t ns = bench::now() - b;
+		rep.add("share").set("bytes", Msg).set("segments", (double)msg.count()).rate(Rounds, ns);
+
+		b = bench::now();
+		for (size_t i = 0; i < Rounds; i++) {
+			std::string c(str);
+			bench::keep(c.size());
+		}
+		ns = bench::now() - b;
+		rep.add("string_copy").set("bytes", Msg).rate(Rounds, ns);
+	}
+
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		// 一次writev提交整个链, 对照逐段write
+		uint64_t b = bench::now();
+		for (size_t i = 0; i < Rounds; i++) {
+			Buf c(msg);
+			while (!c.empty() && c.writev(fd) > 0) {
+			}
+		}
+		uint64_t ns = bench::now() - b;
+		rep.add("writev").set("bytes", Msg).set("segments", (double)msg.count()).rate(Rounds, ns);
+
+		struct iovec v[IOV_MAX];
+		size_t cnt = msg.iov(v, IOV_MAX);
+		b = bench::now();
+		for (size_t i = 0; i < Rounds; i++) {
+			for (size_t k = 0; k < cnt; k++)
+				bench::keep(write(fd, v[k].iov_base, v[k].iov_len));
+		}
+		ns = bench::now() - b;
+		rep.add("write_each").set("bytes", Msg).set("segments", (double)cnt).rate(Rounds, ns);
+
+		close(fd);
+	}
+
+	return rep.write(argc, argv);
+}
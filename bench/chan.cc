@@ -0,0 +1,97 @@
+//
+// Chan: 不同生产者/消费者数量下的吞吐量和端到端延迟
+// 每个元素携带发送时刻, 接收方据此计算延迟
+//
+
+#include "bench.h"
+#include "../chan.h"
+
+namespace {
+	const size_t Items = 200000;
+
+	struct Arg {
+		smp::Chan<uint64_t>*	ch;
+		size_t			n;
+		bench::Lat		lat;
+	};
+
+	void* produce(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			*a->ch << bench::now();
+		return NULL;
+	}
+
+	void* consume(void* p) {
+		Arg* a = (Arg*)p;
+		uint64_t t;
+		while (*a->ch >> t)
+			a->lat.add(bench::now() - t);
+		return NULL;
+	}
+
+	// 生产者和消费者都在parallel中启动, 生产者全部结束后关闭通道
+	struct Run {
+		smp::Chan<uint64_t>*	ch;
+		std::vector<Arg>*	producers;
+		std::vector<Arg>*	consumers;
+	};
+
+	void* producers(void* p) {
+		Run* r = (Run*)p;
+		bench::parallel(produce, *r->producers);
+		r->ch->close();
+		return NULL;
+	}
+
+	void* consumers(void* p) {
+		Run* r = (Run*)p;
+		bench::parallel(consume, *r->consumers);
+		return NULL;
+	}
+
+	void run(bench::Report& rep, int np, int nc, size_t capacity) {
+		smp::Chan<uint64_t> ch(capacity);
+		std::vector<Arg> ps(np), cs(nc);
+
+		for (int i = 0; i < np; i++) {
+			ps[i].ch = &ch;
+			ps[i].n = Items / np;
+		}
+		for (int i = 0; i < nc; i++)
+			cs[i].ch = &ch;
+
+		Run r = {&ch, &ps, &cs};
+		pthread_t tid;
+		uint64_t b = bench::now();
+		pthread_create(&tid, NULL, consumers, &r);
+		producers(&r);
+		pthread_join(tid, NULL);
+		uint64_t ns = bench::now() - b;
+
+		bench::Lat lat;
+		for (int i = 0; i < nc; i++)
+			lat.merge(cs[i].lat);
+
+		rep.add(capacity > 0 ? "bounded" : "unbounded")
+			.set("producers", np)
+			.set("consumers", nc)
+			.set("capacity", (double)capacity)
+			.rate(lat.count(), ns)
+			.lat(lat);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("chan");
+	const int counts[] = {1, 2, 4, 8};
+
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		for (size_t j = 0; j < sizeof(counts) / sizeof(counts[0]); j++) {
+			run(rep, counts[i], counts[j], 0);
+			run(rep, counts[i], counts[j], 1024);
+		}
+	}
+
+	return rep.write(argc, argv);
+}
@@ -0,0 +1,235 @@
+//
+// Conf: 1k和100k个键时各加载模式的耗时, 以及getValue、Pin和预先解析的Key的查找开销
+// 查找以原先std::map嵌套、每次构造临时std::string的findArray为基准
+// 另外把100k个键拆成多个片段用include加载, 与单个文件比较
+//
+
+#include <cstring>
+#include <map>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+#include "../conf.h"
+
+namespace {
+	typedef smp::Conf<1024> Conf;
+
+	const size_t Lookups = 1000000;
+	const int PerSection = 100;
+	const int Fragments = 250;
+
+	// 生成从第first节开始的sections * PerSection个键, 值的类型轮换
+	bool generate(const std::string& name, int sections, int first = 0, const char* head = "name = \"bench\"") {
+		FILE* f = fopen(name.c_str(), "w");
+		if (f == NULL)
+			return false;
+
+		fprintf(f, "# generated by bench_conf\n%s\n", head);
+		for (int s = first; s < first + sections; s++) {
+			fprintf(f, "\n[section%d]\n", s);
+			for (int k = 0; k < PerSection; k++) {
+				switch (k % 4) {
+				case 0: fprintf(f, "\tkey%d = %d\n", k, s * PerSection + k); break;
+				case 1: fprintf(f, "\tkey%d = \"value %d.%d\"\t# comment\n", k, s, k); break;
+				case 2: fprintf(f, "\tkey%d = %dms\n", k, k * 10); break;
+				case 3: fprintf(f, "\tkey%d = [%d, %d, %d]\n", k, s, k, s + k); break;
+				}
+			}
+		}
+
+		return fclose(f) == 0;
+	}
+
+	void load(bench::Report& rep, const std::string& name, size_t keys, const char* what, int mode) {
+		uint64_t b = bench::now();
+		Conf conf(name.c_str(), mode);
+		uint64_t ns = bench::now() - b;
+
+		if (!conf.loadOk())
+			fprintf(stderr, "bench_conf: load %s: %s\n", what, conf.error().c_str());
+
+		rep.add(what)
+			.set("keys", (double)keys)
+			.set("ms", ns / 1e6)
+			.set("ns_per_key", (double)ns / keys);
+	}
+
+	// 主文件只有include, 各片段的节互不重叠
+	bool split(const std::string& dir, int sections) {
+		std::string d = dir + "/conf.d";
+		if (mkdir(d.c_str(), 0755) != 0)
+			return false;
+
+		char buf[64];
+		int per = sections / Fragments;
+		for (int i = 0; i < Fragments; i++) {
+			snprintf(buf, sizeof(buf), "/frag%03d.conf", i);
+			if (!generate(d + buf, per, i * per, i == 0 ? "name = \"bench\"" : ""))
+				return false;
+		}
+
+		return generate(dir + "/main.conf", 0, 0, "include \"conf.d/*.conf\"");
+	}
+
+	void unsplit(const std::string& dir) {
+		char buf[64];
+		for (int i = 0; i < Fragments; i++) {
+			snprintf(buf, sizeof(buf), "/conf.d/frag%03d.conf", i);
+			unlink((dir + buf).c_str());
+		}
+
+		rmdir((dir + "/conf.d").c_str());
+		unlink((dir + "/main.conf.bin").c_str());
+		unlink((dir + "/main.conf").c_str());
+	}
+
+	// 原先的查找方式: {节: {键: 值}}, 全局键值单独一张表
+	class Legacy {
+	public:
+		typedef std::map<std::string, const Conf::Value*> KV;
+
+		~Legacy() {
+			for (std::map<std::string, KV*>::iterator it = sections.begin(); it != sections.end(); ++it)
+				delete it->second;
+		}
+
+		void add(const std::string& sec, const std::string& key, const Conf::Value* v) {
+			if (sec.empty()) {
+				global[key] = v;
+				return;
+			}
+
+			KV*& kv = sections[sec];
+			if (kv == NULL)
+				kv = new KV();
+			(*kv)[key] = v;
+		}
+
+		const Conf::Value* findArray(const char* path) {
+			const char* p = strchr(path, '.');
+			if (p == NULL) {
+				KV::iterator it = global.find(std::string(path));
+				return it != global.end() ? it->second : NULL;
+			}
+
+			std::map<std::string, KV*>::iterator it = sections.find(std::string(path, p - path));
+			if (it == sections.end())
+				return NULL;
+
+			KV::iterator iter = it->second->find(std::string(p + 1));
+			return iter != it->second->end() ? iter->second : NULL;
+		}
+
+	private:
+		KV			global;
+		std::map<std::string, KV*> sections;
+	};
+
+	void lookup(bench::Report& rep, const std::string& name, int sections) {
+		size_t keys = (size_t)sections * PerSection;
+		Conf conf(name.c_str(), Conf::Lmmap);
+
+		// 随机的查找序列, 所有方式使用同一序列
+		std::vector<std::string> paths(4096);
+		std::vector<Conf::Key> ks(paths.size());
+		char buf[64];
+		srand(1);
+		for (size_t i = 0; i < paths.size(); i++) {
+			snprintf(buf, sizeof(buf), "section%d.key%d", rand() % sections, rand() % PerSection);
+			paths[i] = buf;
+			ks[i] = conf.key(buf);
+		}
+
+		// 列表的getValue为NULL, 与原先的行为相同
+		Legacy old;
+		old.add("", "name", conf.getValue("name"));
+		for (int s = 0; s < sections; s++) {
+			for (int k = 0; k < PerSection; k++) {
+				snprintf(buf, sizeof(buf), "section%d.key%d", s, k);
+				old.add(std::string(buf, strchr(buf, '.') - buf), strchr(buf, '.') + 1, conf.getValue(buf));
+			}
+		}
+
+		size_t mask = paths.size() - 1;
+		size_t found = 0;
+		uint64_t b = bench::now();
+		for (size_t i = 0; i < Lookups; i++)
+			found += old.findArray(paths[i & mask].c_str()) != NULL;
+		uint64_t ns = bench::now() - b;
+		rep.add("map_findArray").set("keys", (double)keys).set("found", (double)found).rate(Lookups, ns);
+
+		found = 0;
+		b = bench::now();
+		for (size_t i = 0; i < Lookups; i++)
+			found += conf.getValue(paths[i & mask].c_str()) != NULL;
+		ns = bench::now() - b;
+		rep.add("getValue").set("keys", (double)keys).set("found", (double)found).rate(Lookups, ns);
+
+		found = 0;
+		b = bench::now();
+		{
+			Conf::Pin pin(conf);
+			for (size_t i = 0; i < Lookups; i++)
+				found += pin.getValue(paths[i & mask].c_str()) != NULL;
+		}
+		ns = bench::now() - b;
+		rep.add("pin_getValue").set("keys", (double)keys).set("found", (double)found).rate(Lookups, ns);
+
+		found = 0;
+		b = bench::now();
+		for (size_t i = 0; i < Lookups; i++)
+			found += ks[i & mask].value() != NULL;
+		ns = bench::now() - b;
+		rep.add("key_value").set("keys", (double)keys).set("found", (double)found).rate(Lookups, ns);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("conf");
+	const int sections[] = {10, 1000};
+
+	char dir[] = "/tmp/bench_conf.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+		size_t keys = (size_t)sections[i] * PerSection;
+		std::string name = std::string(dir) + "/bench.conf";
+
+		if (!generate(name, sections[i])) {
+			perror(name.c_str());
+			return 1;
+		}
+
+		load(rep, name, keys, "load_stream", Conf::Lstream);
+		load(rep, name, keys, "load_mmap", Conf::Lmmap);
+		unlink((name + ".bin").c_str());
+		load(rep, name, keys, "load_cache_build", Conf::Lcache);
+		load(rep, name, keys, "load_cache_hit", Conf::Lcache);
+		lookup(rep, name, sections[i]);
+
+		unlink((name + ".bin").c_str());
+		unlink(name.c_str());
+	}
+
+	// 片段在不超过CPU数的线程上并行解析
+	int last = sections[sizeof(sections) / sizeof(sections[0]) - 1];
+	if (!split(dir, last)) {
+		perror(dir);
+		return 1;
+	}
+
+	std::string name = std::string(dir) + "/main.conf";
+	size_t keys = (size_t)last * PerSection;
+	load(rep, name, keys, "include_stream", Conf::Lstream);
+	load(rep, name, keys, "include_mmap", Conf::Lmmap);
+	load(rep, name, keys, "include_cache_build", Conf::Lcache);
+	load(rep, name, keys, "include_cache_hit", Conf::Lcache);
+	unsplit(dir);
+
+	rmdir(dir);
+	return rep.write(argc, argv);
+}
@@ -0,0 +1,75 @@
+//
+// Cchan: 大量协程流水线在少数线程上收发的吞吐量
+// 每条流水线一个生产者和一个消费者协程, 通道容量为1, 几乎每次收发都要挂起和恢复
+//
+
+#include "bench.h"
+#include "../coro.h"
+
+namespace {
+	const int Items = 100;
+
+	typedef smp::Cchan<int> Ch;
+
+	int remaining;
+
+	smp::Spawn producer(Ch& ch) {
+		for (int i = 0; i < Items; i++)
+			if (!co_await ch.send(i))
+				break;
+		ch.close();
+	}
+
+	smp::Spawn consumer(Ch& ch, long* sum) {
+		while (std::optional<int> v = co_await ch.recv())
+			*sum += *v;
+		__atomic_sub_fetch(&remaining, 1, __ATOMIC_RELEASE);
+	}
+
+	void run(bench::Report& rep, int threads, int pipelines) {
+		std::vector<Ch*> chans(pipelines);
+		std::vector<long> sums(pipelines);
+		uint64_t ns;
+
+		{
+			smp::Loop loop(threads);
+			for (int i = 0; i < pipelines; i++)
+				chans[i] = new Ch(loop, 1);
+
+			__atomic_store_n(&remaining, pipelines, __ATOMIC_RELEASE);
+			uint64_t b = bench::now();
+			for (int i = 0; i < pipelines; i++) {
+				consumer(*chans[i], &sums[i]);
+				producer(*chans[i]);
+			}
+			while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE) > 0)
+				sched_yield();
+			ns = bench::now() - b;
+		}
+
+		long expect = (long)Items * (Items - 1) / 2;
+		int bad = 0;
+		for (int i = 0; i < pipelines; i++) {
+			bad += sums[i] != expect;
+			delete chans[i];
+		}
+
+		rep.add("pipelines")
+			.set("threads", threads)
+			.set("pipelines", pipelines)
+			.set("bad", bad)
+			.rate((uint64_t)pipelines * Items, ns);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("coro");
+	const int threads[] = {1, 4};
+	const int pipelines[] = {100, 10000, 50000};
+
+	for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+		for (size_t p = 0; p < sizeof(pipelines) / sizeof(pipelines[0]); p++)
+			run(rep, threads[t], pipelines[p]);
+
+	return rep.write(argc, argv);
+}
@@ -0,0 +1,66 @@
+//
+// Idrs: 不同占用率下分配和归还一个ID的开销
+// 已占用的ID随机分布, get需要跳过它们
+//
+
+#include "bench.h"
+#include "../idrs.h"
+
+namespace {
+	const size_t N = 4096;
+	const size_t Rounds = 200000;
+
+	struct Arg {
+		smp::Idrs<N>*	idrs;
+		size_t		n;
+	};
+
+	void* work(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			a->idrs->put(a->idrs->get());
+		return NULL;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("idrs");
+	const int percents[] = {0, 50, 90, 99};
+	const int threads[] = {1, 4};
+
+	srand(1);
+	for (size_t o = 0; o < sizeof(percents) / sizeof(percents[0]); o++) {
+		for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+			smp::Idrs<N>* idrs = new smp::Idrs<N>(3600);
+
+			// 先全部取出, 再随机归还一部分
+			std::vector<size_t> ids(N);
+			for (size_t i = 0; i < N; i++)
+				ids[i] = idrs->get();
+			for (size_t i = N - 1; i > 0; i--)
+				std::swap(ids[i], ids[rand() % (i + 1)]);
+
+			size_t held = N * percents[o] / 100;
+			for (size_t i = held; i < N; i++)
+				idrs->put(ids[i]);
+
+			std::vector<Arg> args(threads[t]);
+			for (int i = 0; i < threads[t]; i++) {
+				args[i].idrs = idrs;
+				args[i].n = Rounds / threads[t];
+			}
+
+			uint64_t ns = bench::parallel(work, args);
+
+			rep.add("get_put")
+				.set("ids", N)
+				.set("occupancy", percents[o] / 100.0)
+				.set("threads", threads[t])
+				.rate(args[0].n * threads[t], ns);
+
+			delete idrs;
+		}
+	}
+
+	return rep.write(argc, argv);
+}
@@ -0,0 +1,92 @@
+//
+// Pipe: 三阶段流水线在不同批大小和并行度下的吞吐量, 以及各阶段的忙碌比例和队列占用
+//
+
+#include <cstring>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../pipe.h"
+
+namespace {
+	const size_t Items = 500000;
+
+	struct Msg {
+		uint64_t	id;
+		uint64_t	hash;
+		char		text[48];
+	};
+
+	bool parse(Msg& m) {
+		int n = snprintf(m.text, sizeof(m.text), "id=%lu", (unsigned long)m.id);
+		return n > 0;
+	}
+
+	bool enrich(Msg& m) {
+		uint64_t h = 14695981039346656037ULL;
+		for (const char* p = m.text; *p != '\0'; p++)
+			h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+		m.hash = h;
+		return true;
+	}
+
+	uint64_t total;
+
+	bool encode(Msg& m) {
+		__atomic_add_fetch(&total, m.hash & 0xff, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	void run(bench::Report& rep, size_t batch, int threads, bool pin) {
+		smp::Pipe<Msg> pipe(batch);
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		std::vector<int> none;
+
+		pipe.stage("parse", parse, threads, 4096, pin ? pipe.cpus(0, threads) : none)
+			.stage("enrich", enrich, threads, 4096, pin ? pipe.cpus(threads % cpus, threads) : none)
+			.stage("encode", encode, 1, 4096, pin ? pipe.cpus((2 * threads) % cpus) : none);
+
+		uint64_t b = bench::now();
+		pipe.start();
+
+		Msg m;
+		memset(&m, 0, sizeof(m));
+		for (size_t i = 0; i < Items; i++) {
+			m.id = i;
+			pipe.push(m);
+		}
+
+		// stop返回时所有元素都已处理完
+		pipe.stop();
+		uint64_t ns = bench::now() - b;
+
+		std::vector<smp::Pipe<Msg>::Stats> st;
+		pipe.stats(st);
+
+		bench::Result& r = rep.add("pipeline")
+			.set("batch", (double)batch)
+			.set("threads", threads)
+			.set("pinned", pin)
+			.rate(Items, ns);
+
+		for (size_t i = 0; i < st.size(); i++) {
+			std::string k = st[i].name;
+			r.set((k + "_busy").c_str(), st[i].busy);
+			r.set((k + "_occupancy").c_str(), st[i].occupancy);
+			r.set((k + "_peak").c_str(), (double)st[i].peak);
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("pipe");
+	const size_t batches[] = {1, 16, 64, 256};
+
+	for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		run(rep, batches[i], 1, false);
+		run(rep, batches[i], 2, false);
+		run(rep, batches[i], 2, true);
+	}
+
+	return rep.write(argc, argv);
+}
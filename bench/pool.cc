@@ -0,0 +1,64 @@
+//
+// Pool: 多个线程争用同一个池时get/put的开销
+//
+
+#include "bench.h"
+#include "../pool.h"
+
+namespace {
+	const size_t Rounds = 500000;
+
+	struct Obj {
+		char data[64];
+	};
+
+	struct Arg {
+		smp::Pool<Obj>*	pool;
+		size_t		n;
+		int		hold;	// 每轮同时持有的元素数
+	};
+
+	void* work(void* p) {
+		Arg* a = (Arg*)p;
+		Obj* objs[16];
+
+		for (size_t i = 0; i < a->n; i++) {
+			for (int j = 0; j < a->hold; j++)
+				objs[j] = a->pool->get();
+			for (int j = 0; j < a->hold; j++)
+				a->pool->put(objs[j]);
+		}
+
+		return NULL;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("pool");
+	const int threads[] = {1, 2, 4, 8};
+	const int holds[] = {1, 16};
+
+	for (size_t h = 0; h < sizeof(holds) / sizeof(holds[0]); h++) {
+		for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+			smp::Pool<Obj> pool;
+			std::vector<Arg> args(threads[t]);
+
+			for (int i = 0; i < threads[t]; i++) {
+				args[i].pool = &pool;
+				args[i].n = Rounds / threads[t] / holds[h];
+				args[i].hold = holds[h];
+			}
+
+			uint64_t ns = bench::parallel(work, args);
+			size_t ops = args[0].n * holds[h] * threads[t];
+
+			rep.add("get_put")
+				.set("threads", threads[t])
+				.set("hold", holds[h])
+				.set("allocated", (double)pool.cap())
+				.rate(ops, ns);
+		}
+	}
+
+	return rep.write(argc, argv);
+}
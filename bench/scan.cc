@@ -0,0 +1,89 @@
+//
+// Scan: 各指令集下扫描内核的吞吐量
+//
+
+#include "bench.h"
+#include "../scan.h"
+
+namespace {
+	const size_t Size = 1 << 20;
+	const int Repeat = 200;
+
+	const char* const names[] = {"scalar", "sse2", "avx2"};
+
+	// 类似配置文件的文本, 平均行长约40字节
+	void fill(std::string& s) {
+		char line[128];
+		srand(1);
+		while (s.size() < Size) {
+			int n = snprintf(line, sizeof(line), "\tkey%d = \"value %d\"\t\t# comment %d\n",
+					rand() % 1000, rand(), rand() % 100);
+			s.append(line, n);
+		}
+		s.resize(Size);
+	}
+
+	void report(bench::Report& rep, const char* name, int isa, uint64_t ns) {
+		rep.add(name)
+			.set("isa", isa)
+			.set("bytes", (double)Size * Repeat)
+			.set("gb_per_sec", (double)Size * Repeat / ns);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("scan");
+	std::string text;
+	fill(text);
+
+	std::string upper(text);
+	for (size_t i = 0; i < upper.size(); i++)
+		upper[i] = toupper((unsigned char)upper[i]);
+
+	std::string spaces(Size, ' ');
+	std::vector<size_t> offs(Size / 16);
+
+	int best = smp::Scan::use(smp::Scan::Iavx2);
+	for (int isa = smp::Scan::Iscalar; isa <= best; isa++) {
+		smp::Scan::use(isa);
+		const char* name = names[isa];
+		uint64_t b, ns;
+		size_t r = 0;
+
+		// 不存在的字节, 扫描整个缓冲区
+		b = bench::now();
+		for (int i = 0; i < Repeat; i++)
+			r += smp::Scan::findAny(text.data(), text.size(), "\x01\x02\x03");
+		ns = bench::now() - b;
+		report(rep, (std::string("findAny_") + name).c_str(), isa, ns);
+
+		b = bench::now();
+		for (int i = 0; i < Repeat; i++)
+			r += smp::Scan::lines(text.data(), text.size(), &offs[0], offs.size());
+		ns = bench::now() - b;
+		report(rep, (std::string("lines_") + name).c_str(), isa, ns);
+
+		size_t len;
+		b = bench::now();
+		for (int i = 0; i < Repeat; i++)
+			r += smp::Scan::trim(spaces.data(), spaces.size(), &len) != NULL;
+		ns = bench::now() - b;
+		report(rep, (std::string("trim_") + name).c_str(), isa, ns);
+
+		b = bench::now();
+		for (int i = 0; i < Repeat; i++)
+			r += smp::Scan::equalNoCase(text.data(), upper.data(), text.size());
+		ns = bench::now() - b;
+		report(rep, (std::string("equalNoCase_") + name).c_str(), isa, ns);
+
+		b = bench::now();
+		for (int i = 0; i < Repeat; i++)
+			r += smp::Scan::isAscii(text.data(), text.size());
+		ns = bench::now() - b;
+		report(rep, (std::string("isAscii_") + name).c_str(), isa, ns);
+
+		bench::keep(r);
+	}
+
+	return rep.write(argc, argv);
+}
@@ -0,0 +1,113 @@
+//
+// Sole/Tsole/Csole: 取实例的开销, 以及多个线程累加计数时Csole分片与共用一个原子计数的对比
+//
+
+#include "bench.h"
+#include "../sole.h"
+
+namespace {
+	const size_t Rounds = 2000000;
+
+	struct Obj {
+		long v;
+
+		Obj(): v(0) {
+		}
+	};
+
+	struct Counter {
+		unsigned long n;
+
+		Counter(): n(0) {
+		}
+	};
+
+	unsigned long shared;
+
+	// 不内联, 否则循环中对线程局部缓存的读取会被提到循环外
+	__attribute__((noinline)) Obj* getSole() {
+		return smp::Sole<Obj>::instance();
+	}
+
+	__attribute__((noinline)) Obj* getTsole() {
+		return smp::Tsole<Obj>::instance();
+	}
+
+	struct Arg {
+		size_t n;
+	};
+
+	void* sole(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			bench::keep(getSole());
+		return NULL;
+	}
+
+	void* tsole(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			bench::keep(getTsole());
+		return NULL;
+	}
+
+	void* csole(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			__atomic_add_fetch(&smp::Csole<Counter>::instance()->n, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	void* atomic(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			__atomic_add_fetch(&shared, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	unsigned long sum(unsigned long r, const Counter& c) {
+		return r + c.n;
+	}
+
+	struct Case {
+		const char*	name;
+		void*		(*fn)(void*);
+	};
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("sole");
+	const int threads[] = {1, 4, 8};
+	const Case cases[] = {
+		{"sole_instance", sole},
+		{"tsole_instance", tsole},
+		{"csole_count", csole},
+		{"atomic_count", atomic},
+	};
+
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+			std::vector<Arg> args(threads[t]);
+			for (int i = 0; i < threads[t]; i++)
+				args[i].n = Rounds / threads[t];
+
+			uint64_t ns = bench::parallel(cases[c].fn, args);
+			bench::Result& r = rep.add(cases[c].name).set("threads", threads[t]);
+			if (cases[c].fn == csole)
+				r.set("shards", (double)smp::Csole<Counter>::count());
+			r.rate(args[0].n * threads[t], ns);
+		}
+	}
+
+	// 合并所有分片的开销, 读取计数时付出
+	size_t folds = 100000;
+	unsigned long total = 0;
+	uint64_t b = bench::now();
+	for (size_t i = 0; i < folds; i++)
+		total += smp::Csole<Counter>::fold(0UL, sum);
+	uint64_t ns = bench::now() - b;
+	bench::keep(total);
+	rep.add("csole_fold").set("shards", (double)smp::Csole<Counter>::count()).rate(folds, ns);
+
+	return rep.write(argc, argv);
+}
@@ -0,0 +1,163 @@
+//
+// 开启SMP_STAT后Chan, Pool, Idrs和Ulog的开销, 结果之后附上运行后的统计快照,
+// 与bench_chan等未开启统计的结果对比即为统计的代价
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../chan.h"
+#include "../pool.h"
+#include "../idrs.h"
+#include "../ulog.h"
+
+namespace {
+	const size_t Items = 200000;
+	const int Threads = 4;
+
+	struct Obj {
+		char data[64];
+	};
+
+	typedef smp::Ulog<1024> Log;
+
+	struct Arg {
+		smp::Chan<uint64_t>*	ch;
+		smp::Pool<Obj>*		pool;
+		smp::Idrs<4096>*	idrs;
+		Log*			log;
+		size_t			n;
+	};
+
+	void* produce(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			*a->ch << i;
+		return NULL;
+	}
+
+	void* consume(void* p) {
+		Arg* a = (Arg*)p;
+		uint64_t v;
+		while (*a->ch >> v)
+			bench::keep(v);
+		return NULL;
+	}
+
+	void* pool(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			a->pool->put(a->pool->get());
+		return NULL;
+	}
+
+	void* idrs(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			a->idrs->put(a->idrs->get());
+		return NULL;
+	}
+
+	void* ulog(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++)
+			ULOG_INFO(*a->log, "order %lu filled\n", (unsigned long)i);
+		return NULL;
+	}
+
+	struct Mpmc {
+		smp::Chan<uint64_t>*	ch;
+		std::vector<Arg>*	args;
+	};
+
+	void* producers(void* p) {
+		Mpmc* m = (Mpmc*)p;
+		bench::parallel(produce, *m->args);
+		m->ch->close();
+		return NULL;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("stat");
+	std::vector<Arg> args(Threads);
+	uint64_t ns;
+
+	{
+		smp::Chan<uint64_t> ch(1024);
+		for (int i = 0; i < Threads; i++) {
+			args[i].ch = &ch;
+			args[i].n = Items / Threads;
+		}
+
+		Mpmc m = {&ch, &args};
+		pthread_t tid;
+		uint64_t b = bench::now();
+		pthread_create(&tid, NULL, producers, &m);
+		bench::parallel(consume, args);
+		pthread_join(tid, NULL);
+		ns = bench::now() - b;
+		rep.add("chan").set("producers", Threads).set("consumers", Threads).rate(Items, ns);
+	}
+
+	{
+		smp::Pool<Obj> p;
+		for (int i = 0; i < Threads; i++) {
+			args[i].pool = &p;
+			args[i].n = Items / Threads;
+		}
+
+		ns = bench::parallel(pool, args);
+		rep.add("pool").set("threads", Threads).rate(Items, ns);
+	}
+
+	{
+		smp::Idrs<4096>* d = new smp::Idrs<4096>(3600);
+		for (int i = 0; i < 4096 * 9 / 10; i++)
+			d->get();
+		for (int i = 0; i < Threads; i++) {
+			args[i].idrs = d;
+			args[i].n = Items / Threads;
+		}
+
+		ns = bench::parallel(idrs, args);
+		rep.add("idrs").set("threads", Threads).set("occupancy", 0.9).rate(Items, ns);
+		delete d;
+	}
+
+	{
+		int null = open("/dev/null", O_WRONLY);
+		Log log;
+		log.setOutput(null);
+		log.setAsync(1 << 16, Log::Pdrop);
+		for (int i = 0; i < Threads; i++) {
+			args[i].log = &log;
+			args[i].n = Items / Threads;
+		}
+
+		ns = bench::parallel(ulog, args);
+		log.flush();
+		rep.add("ulog").set("threads", Threads).rate(Items, ns);
+		close(null);
+	}
+
+	smp::Stat::Snapshot s;
+	smp::Stat::snapshot(s);
+
+	bench::Result& c = rep.add("counters");
+	for (int i = 0; i < smp::Stat::Cmax; i++)
+		c.set(smp::Stat::counterNames()[i], (double)s.counter(i));
+
+	for (int i = 0; i < smp::Stat::Hmax; i++) {
+		rep.add(smp::Stat::histNames()[i])
+			.set("count", (double)s.count(i))
+			.set("mean", s.mean(i))
+			.set("p50", (double)s.percentile(i, 0.50))
+			.set("p99", (double)s.percentile(i, 0.99))
+			.set("p999", (double)s.percentile(i, 0.999))
+			.set("max", (double)s.max(i));
+	}
+
+	return rep.write(argc, argv);
+}
@@ -0,0 +1,120 @@
+//
+// Tchan: 百万级定时元素的插入、撤销和取出开销, 以及接收时刻相对到期时刻的延迟
+//
+
+#include "bench.h"
+#include "../tick.h"
+
+namespace {
+	typedef smp::Tchan<uint64_t> Tq;
+
+	const size_t Timers = 1000000;
+	const size_t Timed = 20000;
+	const uint64_t Spread = 200000000ULL;	// 延迟测试的到期时刻分布在200ms内
+
+	uint64_t rnd(uint64_t& s) {
+		s ^= s << 13;
+		s ^= s >> 7;
+		s ^= s << 17;
+		return s;
+	}
+
+	struct Arg {
+		Tq*		q;
+		bench::Lat	lat;
+	};
+
+	void* receive(void* p) {
+		Arg* a = (Arg*)p;
+		uint64_t when;
+		while (*a->q >> when)
+			a->lat.add(Tq::now() - when);
+		return NULL;
+	}
+
+	struct Closer {
+		Tq*	q;
+		size_t	n;
+	};
+
+	// 到期时刻分布在Spread内, 全部发出后关闭, 接收者取完后退出
+	void* sendTimed(void* p) {
+		Closer* c = (Closer*)p;
+		uint64_t s = 88172645463325252ULL;
+		uint64_t base = Tq::now() + 10000000ULL;
+		for (size_t i = 0; i < c->n; i++) {
+			uint64_t when = base + rnd(s) % Spread;
+			c->q->send(when, when);
+		}
+		c->q->close();
+		return NULL;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("tick");
+	uint64_t s = 88172645463325252ULL;
+
+	{
+		Tq q;
+		std::vector<uint64_t> ids(Timers);
+		uint64_t base = Tq::now() + 3600000000000ULL;
+
+		uint64_t b = bench::now();
+		for (size_t i = 0; i < Timers; i++)
+			ids[i] = q.send(i, base + rnd(s) % 1000000000ULL);
+		uint64_t ns = bench::now() - b;
+		rep.add("send").set("pending", (double)Timers).rate(Timers, ns);
+
+		for (size_t i = Timers - 1; i > 0; i--)
+			std::swap(ids[i], ids[rnd(s) % (i + 1)]);
+
+		size_t ok = 0;
+		b = bench::now();
+		for (size_t i = 0; i < Timers / 2; i++)
+			ok += q.cancel(ids[i]);
+		ns = bench::now() - b;
+		rep.add("cancel").set("pending", (double)Timers).set("cancelled", (double)ok).rate(Timers / 2, ns);
+	}
+
+	{
+		// 全部已到期, 测量取出的开销
+		Tq q;
+		uint64_t base = Tq::now();
+		for (size_t i = 0; i < Timers; i++)
+			q.send(i, base - 1 - rnd(s) % 1000000000ULL);
+
+		uint64_t v;
+		size_t n = 0;
+		uint64_t b = bench::now();
+		while (q.poll(v))
+			n++;
+		uint64_t ns = bench::now() - b;
+		rep.add("poll").set("pending", (double)Timers).rate(n, ns);
+	}
+
+	const int receivers[] = {1, 4};
+	for (size_t r = 0; r < sizeof(receivers) / sizeof(receivers[0]); r++) {
+		Tq q;
+		std::vector<Arg> args(receivers[r]);
+		for (int i = 0; i < receivers[r]; i++)
+			args[i].q = &q;
+
+		Closer c = {&q, Timed};
+		pthread_t tid;
+		pthread_create(&tid, NULL, sendTimed, &c);
+		bench::parallel(receive, args);
+		pthread_join(tid, NULL);
+
+		bench::Lat lat;
+		for (int i = 0; i < receivers[r]; i++)
+			lat.merge(args[i].lat);
+
+		rep.add("lateness")
+			.set("receivers", receivers[r])
+			.set("timers", (double)lat.count())
+			.lat(lat);
+	}
+
+	return rep.write(argc, argv);
+}
@@ -0,0 +1,128 @@
+//
+// Ulog: 每行日志的耗时
+// 启用/运行期关闭/编译期消除的级别, 同步/异步写出, 文本/二进制, 输出到/dev/null或Fsink
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../ulog.h"
+
+namespace {
+	typedef smp::Ulog<1024> Log;
+	typedef smp::Ulog<1024, Log::Lwarn> Rlog;	// 编译期去掉Lwarn以下的级别
+
+	const size_t Lines = 200000;
+
+	struct Arg {
+		Log*	log;
+		Rlog*	rlog;
+		int	kind;
+		size_t	n;
+	};
+
+	const int Ktext = 0;
+	const int Kbin	= 1;
+	const int Kcompiled = 2;
+
+	void* work(void* p) {
+		Arg* a = (Arg*)p;
+		for (size_t i = 0; i < a->n; i++) {
+			switch (a->kind) {
+			case Ktext:
+				ULOG_INFO(*a->log, "order %lu filled at %.2f by %s\n", (unsigned long)i, i * 0.01, "bench");
+				break;
+			case Kbin:
+				ULOG_BIN(*a->log, Linfo, "order %lu filled at %.2f by %s\n", (unsigned long)i, i * 0.01, "bench");
+				break;
+			case Kcompiled:
+				ULOG_INFO(*a->rlog, "order %lu filled at %.2f by %s\n", (unsigned long)i, i * 0.01, "bench");
+				break;
+			}
+		}
+
+		return NULL;
+	}
+
+	void run(bench::Report& rep, const char* name, Log* log, Rlog* rlog, int kind, int threads) {
+		std::vector<Arg> args(threads);
+		for (int i = 0; i < threads; i++) {
+			args[i].log = log;
+			args[i].rlog = rlog;
+			args[i].kind = kind;
+			args[i].n = Lines / threads;
+		}
+
+		uint64_t ns = bench::parallel(work, args);
+		if (log != NULL)
+			log->flush();
+
+		rep.add(name)
+			.set("threads", threads)
+			.rate(args[0].n * threads, ns)
+			.set("dropped", log != NULL ? (double)log->dropped() : 0);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bench::Report rep("ulog");
+	const int threads[] = {1, 4};
+
+	int null = open("/dev/null", O_WRONLY);
+	if (null < 0) {
+		perror("/dev/null");
+		return 1;
+	}
+
+	char dir[] = "/tmp/bench_ulog.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	std::string path = std::string(dir) + "/bench.log";
+
+	for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		int n = threads[t];
+
+		{
+			Log log;
+			log.setOutput(null);
+			run(rep, "sync_enabled", &log, NULL, Ktext, n);
+
+			log.setLogLevel(Log::Lwarn);
+			run(rep, "sync_disabled", &log, NULL, Ktext, n);
+		}
+
+		{
+			Rlog rlog;
+			rlog.setOutput(null);
+			run(rep, "compiled_out", NULL, &rlog, Kcompiled, n);
+		}
+
+		{
+			Log log;
+			log.setOutput(null);
+			log.setAsync();
+			run(rep, "async_enabled", &log, NULL, Ktext, n);
+			run(rep, "async_binary", &log, NULL, Kbin, n);
+		}
+
+		{
+			smp::Fsink sink(path.c_str(), 64 << 20, 0, 0);
+			Log log;
+			log.setOutput(&sink);
+			run(rep, "fsink_enabled", &log, NULL, Ktext, n);
+			run(rep, "fsink_binary", &log, NULL, Kbin, n);
+		}
+	}
+
+	// 清理Fsink的分段和符号链接
+	std::string cmd = std::string("rm -rf ") + dir;
+	if (system(cmd.c_str()) != 0)
+		fprintf(stderr, "bench_ulog: cannot remove %s\n", dir);
+
+	close(null);
+	return rep.write(argc, argv);
+}
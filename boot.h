@@ -0,0 +1,331 @@
+//
+// 按依赖顺序并行创建单例, 按相反顺序销毁
+//
+// Boot boot;
+// boot.add<Logger>("log");
+// boot.add<Config>("conf", "log");
+// boot.add<Pools>("pools", "log, conf");
+// boot.start(4);	// 无依赖关系的单例在4个线程上并行创建
+// ...
+// boot.stop();		// 先销毁pools, 再conf, 最后log
+//
+
+#ifndef SMP_BOOT_H
+#define SMP_BOOT_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <cctype>
+#include <pthread.h>
+
+#include "chan.h"
+#include "sole.h"
+
+namespace smp {
+	class Boot {
+	public:
+		Boot(): started(false) {
+		}
+
+		~Boot() {
+		}
+
+		// 登记Sole<T>, deps为逗号分隔的依赖名称, 名称重复返回false
+		template <typename T>
+		bool add(const char* name, const char* deps = NULL) {
+			return add(name, deps, create<T>, destroy<T>);
+		}
+
+		// 登记自定义的创建和销毁函数, fini可以为NULL
+		bool add(const char* name, const char* deps, void (*init)(), void (*fini)()) {
+			if (started || name == NULL || init == NULL || find(name) >= 0)
+				return false;
+
+			Node node;
+			node.name = name;
+			node.init = init;
+			node.fini = fini;
+			node.ns = -1;
+			node.wait = 0;
+
+			const char* p = deps;
+			while (p != NULL && *p != '\0') {
+				const char* q = p;
+				while (*q != '\0' && *q != ',')
+					q++;
+
+				const char* b = p;
+				const char* e = q;
+				while (b < e && isspace(*b))
+					b++;
+				while (e > b && isspace(*(e - 1)))
+					e--;
+
+				if (b < e)
+					node.deps.push_back(std::string(b, e - b));
+
+				p = *q == ',' ? q + 1 : q;
+			}
+
+			nodes.push_back(node);
+			return true;
+		}
+
+		// 创建所有单例, threads为工作线程数
+		// 返回0成功, -1依赖不存在, -2存在循环依赖, -3有单例创建失败(抛出异常)
+		// 失败时依赖失败单例的单例不会被创建, 已创建的单例仍可用stop()销毁
+		int start(size_t threads = 4) {
+			if (started)
+				return 0;
+
+			int err = link();
+			if (err != 0)
+				return err;
+
+			started = true;
+			if (nodes.empty())
+				return 0;
+
+			if (threads == 0)
+				threads = 1;
+			if (threads > nodes.size())
+				threads = nodes.size();
+
+			std::vector<pthread_t> tids(threads);
+			size_t n = 0;
+			for (size_t i = 0; i < threads; i++) {
+				if (pthread_create(&tids[n], NULL, worker, this) == 0)
+					n++;
+			}
+
+			// 无法创建线程时在当前线程依次创建
+			if (n == 0)
+				return serial();
+
+			// 由当前线程调度: 向ready发送可以创建的单例, 从done接收完成的单例
+			size_t pending = 0;
+			for (size_t i = 0; i < nodes.size(); i++) {
+				if (nodes[i].wait == 0) {
+					ready << i;
+					pending++;
+				}
+			}
+
+			err = 0;
+			while (pending > 0) {
+				Done d;
+				done >> d;
+				pending--;
+
+				nodes[d.id].ns = d.ns;
+				if (!d.ok) {
+					failed = nodes[d.id].name;
+					err = -3;
+					continue;
+				}
+
+				order.push_back(d.id);
+				for (size_t j = 0; j < nodes[d.id].next.size(); j++) {
+					size_t k = nodes[d.id].next[j];
+					if (--nodes[k].wait == 0) {
+						ready << k;
+						pending++;
+					}
+				}
+			}
+
+			ready.close();
+			for (size_t i = 0; i < n; i++)
+				pthread_join(tids[i], NULL);
+
+			return err;
+		}
+
+		// 按创建顺序的逆序销毁
+		void stop() {
+			for (std::vector<size_t>::reverse_iterator it = order.rbegin(); it != order.rend(); ++it) {
+				if (nodes[*it].fini != NULL)
+					nodes[*it].fini();
+			}
+
+			order.clear();
+		}
+
+		// 单例的创建耗时(纳秒), 未创建返回-1
+		long long timing(const char* name) const {
+			int i = find(name);
+			return i < 0 ? -1 : nodes[i].ns;
+		}
+
+		// 出错的单例名称: 不存在的依赖、环上的单例或创建失败的单例
+		const std::string& error() const {
+			return failed;
+		}
+
+		void dump() {
+			for (size_t i = 0; i < order.size(); i++) {
+				const Node& node = nodes[order[i]];
+				std::cout << "{ \"" << node.name << "\" : " << node.ns << " }" << std::endl;
+			}
+		}
+
+	private:
+		Boot(const Boot&);
+		Boot& operator = (const Boot&);
+
+		template <typename T>
+		static void create() {
+			Sole<T>::instance();
+		}
+
+		template <typename T>
+		static void destroy() {
+			Sole<T>::destroy();
+		}
+
+	private:
+		struct Node {
+			std::string		name;
+			std::vector<std::string> deps;
+			std::vector<size_t>	next;	// 依赖本单例的单例
+			size_t			wait;	// 尚未创建的依赖数
+			void			(*init)();
+			void			(*fini)();
+			long long		ns;
+		};
+
+		struct Done {
+			size_t		id;
+			bool		ok;
+			long long	ns;
+		};
+
+		int find(const char* name) const {
+			for (size_t i = 0; i < nodes.size(); i++) {
+				if (nodes[i].name == name)
+					return (int)i;
+			}
+
+			return -1;
+		}
+
+		// 建立依赖边并检查环
+		int link() {
+			for (size_t i = 0; i < nodes.size(); i++) {
+				nodes[i].next.clear();
+				nodes[i].wait = 0;
+			}
+
+			for (size_t i = 0; i < nodes.size(); i++) {
+				for (size_t j = 0; j < nodes[i].deps.size(); j++) {
+					int d = find(nodes[i].deps[j].c_str());
+					if (d < 0) {
+						failed = nodes[i].deps[j];
+						return -1;
+					}
+
+					nodes[d].next.push_back(i);
+					nodes[i].wait++;
+				}
+			}
+
+			std::vector<size_t> wait(nodes.size());
+			std::vector<size_t> q;
+			for (size_t i = 0; i < nodes.size(); i++) {
+				wait[i] = nodes[i].wait;
+				if (wait[i] == 0)
+					q.push_back(i);
+			}
+
+			for (size_t h = 0; h < q.size(); h++) {
+				for (size_t j = 0; j < nodes[q[h]].next.size(); j++) {
+					size_t k = nodes[q[h]].next[j];
+					if (--wait[k] == 0)
+						q.push_back(k);
+				}
+			}
+
+			if (q.size() != nodes.size()) {
+				for (size_t i = 0; i < nodes.size(); i++) {
+					if (wait[i] != 0) {
+						failed = nodes[i].name;
+						break;
+					}
+				}
+
+				return -2;
+			}
+
+			return 0;
+		}
+
+		// 无法创建线程时按拓扑顺序依次创建
+		int serial() {
+			std::vector<size_t> q;
+			for (size_t i = 0; i < nodes.size(); i++) {
+				if (nodes[i].wait == 0)
+					q.push_back(i);
+			}
+
+			for (size_t h = 0; h < q.size(); h++) {
+				Done d = run(q[h]);
+				nodes[d.id].ns = d.ns;
+				if (!d.ok) {
+					failed = nodes[d.id].name;
+					return -3;
+				}
+
+				order.push_back(d.id);
+				for (size_t j = 0; j < nodes[d.id].next.size(); j++) {
+					size_t k = nodes[d.id].next[j];
+					if (--nodes[k].wait == 0)
+						q.push_back(k);
+				}
+			}
+
+			return 0;
+		}
+
+		Done run(size_t id) {
+			struct timespec b, e;
+			Done d;
+
+			d.id = id;
+			d.ok = true;
+
+			clock_gettime(CLOCK_MONOTONIC, &b);
+			try {
+				nodes[id].init();
+			} catch (...) {
+				d.ok = false;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &e);
+
+			d.ns = (e.tv_sec - b.tv_sec) * 1000000000LL + (e.tv_nsec - b.tv_nsec);
+			return d;
+		}
+
+		static void* worker(void* arg) {
+			Boot* boot = (Boot*)arg;
+			size_t id;
+
+			while (boot->ready >> id)
+				boot->done << boot->run(id);
+
+			return NULL;
+		}
+
+	private:
+		std::vector<Node>	nodes;
+		std::vector<size_t>	order;		// 创建完成的顺序
+		std::string		failed;
+		bool			started;
+
+		Chan<size_t>		ready;
+		Chan<Done>		done;
+	};
+}
+
+#endif
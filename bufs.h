@@ -0,0 +1,377 @@
+//
+// 引用计数的缓冲区链, 切片共享存储, 支持分散/聚集读写
+//
+
+#ifndef SMP_BUFS_H
+#define SMP_BUFS_H
+
+#include <deque>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "buff.h"
+#include "pool.h"
+#include "sole.h"
+
+namespace smp {
+	// N: 每个块的字节数, 块从进程内共享的Pool中分配
+	// 同一个Bufs对象不能被多个线程同时操作,
+	// 但共享存储的不同Bufs(拷贝或切片)可以分别交给不同线程或通道
+	template<size_t N>
+	class Bufs {
+	public:
+		Bufs(): len(0) {
+		}
+
+		// 拷贝只增加块的引用计数, 不拷贝数据
+		Bufs(const Bufs& b): segs(b.segs), len(b.len) {
+			for (typename std::deque<Seg>::iterator it = segs.begin(); it != segs.end(); ++it)
+				ref(it->blk);
+		}
+
+		Bufs& operator = (const Bufs& b) {
+			if (this != &b) {
+				Bufs t(b);
+				swap(t);
+			}
+
+			return *this;
+		}
+
+		~Bufs() {
+			clear();
+		}
+
+		// 数据总长度
+		size_t size() const {
+			return len;
+		}
+
+		bool empty() const {
+			return len == 0;
+		}
+
+		// 段数
+		size_t count() const {
+			return segs.size();
+		}
+
+		void clear() {
+			for (typename std::deque<Seg>::iterator it = segs.begin(); it != segs.end(); ++it)
+				unref(it->blk);
+
+			segs.clear();
+			len = 0;
+		}
+
+		void swap(Bufs& b) {
+			segs.swap(b.segs);
+
+			size_t n = len;
+			len = b.len;
+			b.len = n;
+		}
+
+		// 追加数据, 先填满尾部块的剩余空间, 分配失败返回false(已追加的部分保留)
+		bool append(const void* data, size_t n) {
+			const char* s = (const char*)data;
+
+			if (!segs.empty()) {
+				Seg& t = segs.back();
+				size_t k = claim(t, n);
+				if (k > 0) {
+					memcpy(t.blk->buff.data() + t.off + t.len, s, k);
+					t.len += k;
+					len += k;
+					s += k;
+					n -= k;
+				}
+			}
+
+			while (n > 0) {
+				Block* b = alloc();
+				if (b == NULL)
+					return false;
+
+				size_t k = n < N ? n : N;
+				memcpy(b->buff.data(), s, k);
+				b->used = k;
+
+				Seg seg = {b, 0, k};
+				segs.push_back(seg);
+				len += k;
+				s += k;
+				n -= k;
+			}
+
+			return true;
+		}
+
+		// 追加另一个链, 共享存储
+		void append(const Bufs& b) {
+			// 先拷贝段表, 允许b就是自身
+			std::deque<Seg> t(b.segs);
+			for (typename std::deque<Seg>::iterator it = t.begin(); it != t.end(); ++it) {
+				ref(it->blk);
+				segs.push_back(*it);
+				len += it->len;
+			}
+		}
+
+		// 在头部插入数据, 数据放入新分配的块
+		bool prepend(const void* data, size_t n) {
+			Bufs t;
+			if (!t.append(data, n))
+				return false;
+
+			prepend(t);
+			return true;
+		}
+
+		// 在头部插入另一个链, 共享存储
+		void prepend(const Bufs& b) {
+			std::deque<Seg> t(b.segs);
+			for (typename std::deque<Seg>::reverse_iterator it = t.rbegin(); it != t.rend(); ++it) {
+				ref(it->blk);
+				segs.push_front(*it);
+				len += it->len;
+			}
+		}
+
+		// 取[off, off + n)的切片, 与原链共享存储, 超出范围的部分被截断
+		Bufs slice(size_t off, size_t n) const {
+			Bufs b;
+
+			for (typename std::deque<Seg>::const_iterator it = segs.begin(); it != segs.end() && n > 0; ++it) {
+				if (off >= it->len) {
+					off -= it->len;
+					continue;
+				}
+
+				size_t k = it->len - off;
+				if (k > n)
+					k = n;
+
+				Seg seg = {it->blk, it->off + off, k};
+				ref(seg.blk);
+				b.segs.push_back(seg);
+				b.len += k;
+
+				off = 0;
+				n -= k;
+			}
+
+			return b;
+		}
+
+		// 丢弃头部n字节
+		void consume(size_t n) {
+			while (n > 0 && !segs.empty()) {
+				Seg& h = segs.front();
+				if (n < h.len) {
+					h.off += n;
+					h.len -= n;
+					len -= n;
+					return;
+				}
+
+				n -= h.len;
+				len -= h.len;
+				unref(h.blk);
+				segs.pop_front();
+			}
+		}
+
+		// 从off开始拷贝最多n字节到dst, 返回实际拷贝的字节数
+		size_t copy(void* dst, size_t off, size_t n) const {
+			char* d = (char*)dst;
+			size_t total = 0;
+
+			for (typename std::deque<Seg>::const_iterator it = segs.begin(); it != segs.end() && n > 0; ++it) {
+				if (off >= it->len) {
+					off -= it->len;
+					continue;
+				}
+
+				size_t k = it->len - off;
+				if (k > n)
+					k = n;
+
+				memcpy(d + total, it->blk->buff.data() + it->off + off, k);
+				total += k;
+				off = 0;
+				n -= k;
+			}
+
+			return total;
+		}
+
+		// 填充iovec, 最多max段, 返回填充的段数
+		size_t iov(struct iovec* v, size_t max) const {
+			size_t i = 0;
+			for (typename std::deque<Seg>::const_iterator it = segs.begin(); it != segs.end() && i < max; ++it, ++i) {
+				v[i].iov_base = it->blk->buff.data() + it->off;
+				v[i].iov_len = it->len;
+			}
+
+			return i;
+		}
+
+		// 聚集写: 一次writev提交整个链(超过IOV_MAX段时只提交前IOV_MAX段)
+		// 已写出的数据从链头移除, 返回值同writev
+		ssize_t writev(int fd) {
+			struct iovec v[IOV_MAX];
+
+			if (segs.empty())
+				return 0;
+
+			ssize_t n = ::writev(fd, v, (int)iov(v, IOV_MAX));
+			if (n > 0)
+				consume((size_t)n);
+
+			return n;
+		}
+
+		// 分散读: 一次readv最多读取n字节追加到链尾, 返回值同readv
+		ssize_t readv(int fd, size_t n) {
+			struct iovec v[IOV_MAX];
+			Block* blks[IOV_MAX];
+			size_t cnt = 0;
+			size_t head = 0;	// 尾部块中认领的空间
+
+			if (n == 0)
+				return 0;
+
+			if (!segs.empty()) {
+				Seg& t = segs.back();
+				head = claim(t, n);
+				if (head > 0) {
+					v[cnt].iov_base = t.blk->buff.data() + t.off + t.len;
+					v[cnt].iov_len = head;
+					cnt++;
+				}
+			}
+
+			size_t want = head;
+			while (want < n && cnt < IOV_MAX) {
+				Block* b = alloc();
+				if (b == NULL)
+					break;
+
+				size_t k = n - want < N ? n - want : N;
+				blks[cnt] = b;
+				v[cnt].iov_base = b->buff.data();
+				v[cnt].iov_len = k;
+				cnt++;
+				want += k;
+			}
+
+			if (cnt == 0) {
+				errno = ENOMEM;
+				return -1;
+			}
+
+			ssize_t r = ::readv(fd, v, (int)cnt);
+			size_t got = r > 0 ? (size_t)r : 0;
+
+			size_t i = 0;
+			if (head > 0) {
+				Seg& t = segs.back();
+				size_t k = got < head ? got : head;
+				// 归还未用到的认领空间, 只有本链能在这段空间之后追加
+				__atomic_store_n(&t.blk->used, t.off + t.len + k, __ATOMIC_RELEASE);
+				t.len += k;
+				len += k;
+				got -= k;
+				i = 1;
+			}
+
+			for (; i < cnt; i++) {
+				size_t k = got < v[i].iov_len ? got : v[i].iov_len;
+				if (k == 0) {
+					unref(blks[i]);
+					continue;
+				}
+
+				blks[i]->used = k;
+				Seg seg = {blks[i], 0, k};
+				segs.push_back(seg);
+				len += k;
+				got -= k;
+			}
+
+			return r;
+		}
+
+		// 释放池中缓存的空闲块
+		static void clean() {
+			pool()->clean();
+		}
+
+	private:
+		struct Block {
+			Block(): refs(0), used(0) {
+			}
+
+			Buff<char, N>	buff;
+			int		refs;
+			size_t		used;	// 已写入的字节数, 块回收前只增不减
+		};
+
+		struct Seg {
+			Block*	blk;
+			size_t	off;
+			size_t	len;
+		};
+
+		static Pool<Block>* pool() {
+			return Sole<Pool<Block> >::instance();
+		}
+
+		static Block* alloc() {
+			Block* b = pool()->get();
+			if (b != NULL) {
+				b->refs = 1;
+				b->used = 0;
+			}
+
+			return b;
+		}
+
+		static void ref(Block* b) {
+			__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+		}
+
+		static void unref(Block* b) {
+			if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+				pool()->put(b);
+		}
+
+		// 段的结尾恰好是块的写入位置时, 可以认领块中剩余的空间继续写入
+		// 多个共享该块的链中只有一个能认领成功
+		static size_t claim(Seg& t, size_t n) {
+			size_t end = t.off + t.len;
+			size_t used = __atomic_load_n(&t.blk->used, __ATOMIC_ACQUIRE);
+
+			if (used != end || used >= N)
+				return 0;
+
+			size_t k = N - used < n ? N - used : n;
+			if (!__atomic_compare_exchange_n(&t.blk->used, &used, used + k, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return 0;
+
+			return k;
+		}
+
+	private:
+		std::deque<Seg>	segs;
+		size_t		len;
+	};
+}
+
+#endif
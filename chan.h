@@ -7,12 +7,36 @@
 #define SMP_CHAN_H
 
 #include <queue>
+#include <deque>
 #include <pthread.h>
 
+#include "stat.h"
+
 namespace smp {
 	template<typename T>
 	class Chan {
 	public:
+		// 不阻塞线程的收发结果
+		static const int Rok	 = 0;
+		static const int Rclosed = 1;
+		static const int Rwait	 = 2;		// 已登记等待, 完成时通知
+
+		// 不阻塞线程的等待者, 如挂起的协程(见coro.h)
+		// 接收时通道把元素直接写入*data, 发送时从*data取出元素
+		// 通道在qlock之外调用done, 之后不再访问等待者
+		class Waiter {
+		public:
+			Waiter(): data(NULL) {
+			}
+
+			virtual ~Waiter() {
+			}
+
+			virtual void done(int result) = 0;
+
+			T*	data;
+		};
+
 		// 默认容量不限, 发送不会阻塞
 		// 指定容量，容量空间满时发送会阻塞
 		Chan(size_t capacity = 0): closed(false), c(capacity) {
@@ -28,9 +52,9 @@ namespace smp {
 		}
 
 		size_t len() {
-			pthread_mutex_lock(&qlock);
+			acquire();
 			size_t len = q.size();
-			pthread_mutex_unlock(&qlock);
+			release();
 
 			return len;
 		}
@@ -44,53 +68,193 @@ namespace smp {
 		// 向通道发送数据, 如果通道已关闭，立即返回false
 		// 如果通道容量空间未满，则发送数据返回true, 否则, 等待通道有可用容量空间时发送，返回true
 		bool operator << (const T& item) {
-			pthread_mutex_lock(&qlock);
+			acquire();
 			if (closed) {
-				pthread_mutex_unlock(&qlock);
+				release();
 				return false;
 			}
 
 			while(c > 0 && q.size() >= c) {
-				pthread_cond_wait(&qless, &qlock);
+				wait(&qless, Stat::Hchansend);
 			}
 
-			q.push(item);
-			pthread_mutex_unlock(&qlock);
-			pthread_cond_signal(&qmore);
+			put(item);
 			return true;
 		}
 
 		// 关闭通道，不再向通道发送数据
 		// close并不会清理掉未取出的元素
+		// 等待接收的Waiter以Rclosed完成; 与阻塞的发送线程一样, 等待发送的Waiter在有空间后仍会发送成功
 		void close() {
-			pthread_mutex_lock(&qlock);
+			acquire();
 			closed = true;
-			pthread_mutex_unlock(&qlock);
+			std::deque<Waiter*> rs;
+			rs.swap(rwait);
+			release();
 			pthread_cond_broadcast(&qmore);
+
+			for (size_t i = 0; i < rs.size(); i++)
+				rs[i]->done(Rclosed);
 		}
 
 		// 从通道接收数据，有数据则返会返回true, 没有数据时会阻塞
 		// 如果通道已被关闭，读完数据后立即返回false
 		bool operator >> (T& item) {
-			pthread_mutex_lock(&qlock);
+			acquire();
 			while (!closed && q.empty()) {
-				pthread_cond_wait(&qmore, &qlock);
+				wait(&qmore, Stat::Hchanrecv);
 			}
 
 			// 非空
 			if (!q.empty()) {
-				item = q.front();
-				q.pop();
-				pthread_mutex_unlock(&qlock);
-				pthread_cond_signal(&qless);
+				take(item);
 				return true;
 			}
 
 			// 空了且已关闭
-			pthread_mutex_unlock(&qlock);
+			release();
+			return false;
+		}
+
+		// 不阻塞线程地发送*w->data
+		// 已关闭返回Rclosed, 能立即发送返回Rok, 否则登记w并返回Rwait, 之后发送成功时调用w->done(Rok)
+		int send(Waiter* w) {
+			acquire();
+			if (closed) {
+				release();
+				return Rclosed;
+			}
+
+			if (c > 0 && q.size() >= c) {
+				swait.push_back(w);
+				release();
+				return Rwait;
+			}
+
+			put(*w->data);
+			return Rok;
+		}
+
+		// 不阻塞线程地接收到*w->data
+		// 有数据返回Rok, 已关闭且没有数据返回Rclosed, 否则登记w并返回Rwait,
+		// 之后数据到达时调用w->done(Rok), 关闭时调用w->done(Rclosed)
+		int recv(Waiter* w) {
+			acquire();
+			if (!q.empty()) {
+				take(*w->data);
+				return Rok;
+			}
+
+			if (closed) {
+				release();
+				return Rclosed;
+			}
+
+			rwait.push_back(w);
+			release();
+			return Rwait;
+		}
+
+		// 撤销登记的等待, w已完成或正在完成时返回false
+		bool cancel(Waiter* w) {
+			acquire();
+			bool found = erase(rwait, w) || erase(swait, w);
+			release();
+
+			return found;
+		}
+
+	private:
+		// 持有qlock时调用, 返回前释放
+		// 有等待接收者时直接交给它, 否则入队
+		void put(const T& item) {
+			Waiter* w = NULL;
+			if (!rwait.empty()) {
+				w = rwait.front();
+				rwait.pop_front();
+				*w->data = item;
+			} else {
+				SMP_STAT_REC(Hchandepth, q.size());
+				q.push(item);
+			}
+			release();
+
+			SMP_STAT_ADD(Cchansend, 1);
+			if (w != NULL) {
+				SMP_STAT_ADD(Cchanrecv, 1);
+				w->done(Rok);
+				return;
+			}
+
+			SMP_STAT_ADD(Cchandepth, 1);
+			pthread_cond_signal(&qmore);
+		}
+
+		// 持有qlock且队列非空时调用, 返回前释放
+		// 取出后把等待发送者的元素补入队列
+		void take(T& item) {
+			item = q.front();
+			q.pop();
+
+			Waiter* w = NULL;
+			if (!swait.empty()) {
+				w = swait.front();
+				swait.pop_front();
+				q.push(*w->data);
+			}
+			release();
+
+			SMP_STAT_ADD(Cchanrecv, 1);
+			if (w != NULL) {
+				SMP_STAT_ADD(Cchansend, 1);
+				w->done(Rok);
+				return;
+			}
+
+			SMP_STAT_ADD(Cchandepth, -1);
+			pthread_cond_signal(&qless);
+		}
+
+		static bool erase(std::deque<Waiter*>& ws, Waiter* w) {
+			for (size_t i = 0; i < ws.size(); i++) {
+				if (ws[i] == w) {
+					ws.erase(ws.begin() + i);
+					return true;
+				}
+			}
+
 			return false;
 		}
 
+		// 定义SMP_STAT时记录qlock的等待和持有时间, 以及收发阻塞的时间
+#ifdef SMP_STAT
+		void acquire() {
+			held = Stat::lock(&qlock, Stat::Hchanlockwait);
+		}
+
+		void release() {
+			Stat::unlock(&qlock, Stat::Hchanlockhold, held);
+		}
+
+		void wait(pthread_cond_t* cv, int blocked) {
+			held = Stat::wait(cv, &qlock, Stat::Hchanlockhold, blocked, held);
+		}
+
+		uint64_t	held;		// 取得qlock的时刻
+#else
+		void acquire() {
+			pthread_mutex_lock(&qlock);
+		}
+
+		void release() {
+			pthread_mutex_unlock(&qlock);
+		}
+
+		void wait(pthread_cond_t* cv, int) {
+			pthread_cond_wait(cv, &qlock);
+		}
+#endif
+
 	private:
 		std::queue<T>	q;
 		pthread_mutex_t qlock;
@@ -101,6 +265,9 @@ namespace smp {
 
 		const size_t	c;
 
+		std::deque<Waiter*> rwait;	// 等待接收, 此时队列为空
+		std::deque<Waiter*> swait;	// 等待发送, 此时队列已满
+
 	private:
 		Chan(Chan& ch);
 		Chan& operator = (const Chan&);
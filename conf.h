@@ -12,6 +12,19 @@
 //	serverport = 8080		# 端口
 //	alloweduser = ["testuser1", "testuser2", "testuser5"]	# 允许的用户
 //	allowedclient = ["10.21.20.115", "10.21.20.116"]	# 允许的客户端
+//	timeout = 500ms		# 时间: ns us ms s m h d
+//	maxbody = 4MB		# 大小: B K KB KiB M MB MiB G GB GiB T TB TiB, 都按1024计
+//	ports = [8080, 8081]
+//
+// 值在加载时解析为整数、浮点数、布尔值、时间、大小或字符串
+// 数字开头、后面跟着无法识别的字母(如3com, 64bit)或超出int64范围的值按字符串处理
+// 单位能识别但数值超出范围的值(如99999999999TB)会使加载失败
+//
+// include "conf.d/*.conf"	# 包含其他文件, 相对路径相对于本文件所在的目录
+//
+// 包含的片段按文件名排序, 在多个线程上并行解析后合并
+// 主文件中的键覆盖片段中的同名键; 主文件没有定义、却在多个片段中出现的键使加载失败
+// 片段中不能再包含其他文件
 //
 
 #ifndef SMP_CONF_H
@@ -20,415 +33,1959 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <new>
+#include <stdint.h>
 #include <string>
-#include <map>
 #include <vector>
 #include <fstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <glob.h>
+#include <cstdio>
+
+#include "scan.h"
 
 namespace smp {
+	// 自相对指针: 保存目标相对自身的偏移, 整块内存映射到任意地址都有效
+	// 拷贝时重新计算偏移
+	template<typename T>
+	class Rel {
+	public:
+		Rel(): off(0) {
+		}
+
+		Rel(const Rel& r) {
+			set(r);
+		}
+
+		Rel& operator = (const Rel& r) {
+			set(r);
+			return *this;
+		}
+
+		Rel& operator = (T* p) {
+			set(p);
+			return *this;
+		}
+
+		operator T* () const {
+			return off == 0 ? NULL : (T*)((const char*)this + off);
+		}
+
+	private:
+		void set(T* p) {
+			off = p == NULL ? 0 : (const char*)p - (const char*)this;
+		}
+
+	private:
+		int64_t off;
+	};
+
 	template<size_t N>
 	class Conf {
 	public:
+		static const int Lstream = 0;	// 用ifstream逐行读取, 每行不超过N字节
+		static const int Lmmap	 = 1;	// mmap整个文件一次解析, 行长不限, 键值直接指向映射的内存
+		static const int Lcache	 = 2;	// 同Lmmap, 另外把解析结果保存为二进制镜像,
+						// 源文件内容不变时直接映射镜像使用, 不再解析
+
+		// 值的文本是指向文件内容(或读入的行)的视图, 生命期与Conf相同
+		// 数值在加载时已解析好, 转换只是读取字段
 		class Value {
 		public:
-			Value(const char* v): val(v) {
+			static const int Tstring   = 0;
+			static const int Tint	   = 1;
+			static const int Tfloat	   = 2;
+			static const int Tbool	   = 3;
+			static const int Tduration = 4;	// 数值为纳秒
+			static const int Tsize	   = 5;	// 数值为字节
+
+			int type() const {
+				return t;
+			}
+
+			std::string toString() const {
+				return std::string(data(), n);
 			}
 
-			Value(const Value& v): val(v.val) {
+			const char* data() const {
+				return (const char*)s;
 			}
 
-			const std::string& toString() const {
-				return val;
+			size_t size() const {
+				return n;
 			}
 
+			// 字符串的数值为0, 浮点数截断为整数
 			int toInt() const {
-				return std::atoi(val.c_str());
+				return (int)i;
 			}
 
 			long toLong() const {
-				return std::atol(val.c_str());
+				return (long)i;
+			}
+
+			int64_t toInt64() const {
+				return i;
 			}
 
 			double toFloat() const {
-				return std::atof(val.c_str());
+				return f;
 			}
 
+			// 除"0", "false", "False", "FALSE"之外都为真
 			bool toBool() const {
-				return (val != "0" && val != "false" && val != "False") ? true : false;
+				return b;
 			}
 
 		private:
-			std::string val;
+			friend class Conf;
+
+			Rel<const char>	s;
+			uint32_t	n;
+			int		t;
+			bool		b;
+			int64_t		i;
+			double		f;
 		};
 
 		class Array {
 		public:
-			Array() {
-				vect.reserve(16);
-			}
-
 			size_t size() const {
-				return vect.size();
+				return n;
 			}
 
 			const Value* at(size_t i) const {
-				return &vect[i];
+				return &vals[i];
+			}
+
+			// 所有值都是整数(包括时间和大小)时返回连续的整数数组, 否则返回NULL
+			const int64_t* ints() const {
+				return (const int64_t*)is;
+			}
+
+			// 所有值都是数值时返回连续的浮点数数组, 否则返回NULL
+			const double* floats() const {
+				return (const double*)fs;
+			}
+
+		private:
+			friend class Conf;
+
+			Rel<const Value> vals;
+			size_t		n;
+			Rel<const int64_t> is;
+			Rel<const double> fs;
+		};
+
+		// 预先解析的键, 之后访问不再查找和分配内存
+		// 解析结果按快照代数缓存, 重新加载后第一次访问时重新解析
+		// Conf::Key port = conf.key("proxy.serverport");
+		// port.value()->toInt();
+		class Key {
+		public:
+			Key(): conf(NULL), cache(0) {
+			}
+
+			// 键不存在返回false
+			bool exists() const {
+				return conf != NULL && conf->resolve(*this, conf->current()) != NULL;
+			}
+
+			// 与getValue相同, 值不是单个时返回NULL
+			const Value* value() const {
+				return conf == NULL ? NULL : single(conf->resolve(*this, conf->current()));
+			}
+
+			// 与getArray相同, 值是单个时返回NULL
+			const Array* array() const {
+				return conf == NULL ? NULL : multi(conf->resolve(*this, conf->current()));
 			}
 
 		private:
 			friend class Conf;
-			void add(const Value& v) {
-				vect.push_back(v);
+
+			Conf*		conf;
+			std::string	path;
+			mutable uint64_t cache;	// 高32位为快照代数, 低32位为条目下标加1, 0表示不存在
+		};
+
+		// 固定当前快照, 在Pin的生命期内取得的值不会因重新加载而失效
+		// 读者不加锁, 旧快照在所有固定它的读者退出后才回收
+		// Conf::Pin pin(conf);
+		// pin.getValue("proxy.serverport")->toInt();
+		class Pin {
+		public:
+			Pin(Conf& c): conf(c) {
+				t = conf.pin(slot);
+			}
+
+			~Pin() {
+				conf.unpin(slot);
+			}
+
+			const Value* getValue(const char* path) const {
+				return single(conf.find(t, path));
 			}
 
+			const Array* getArray(const char* path) const {
+				return multi(conf.find(t, path));
+			}
+
+			const Value* value(const Key& k) const {
+				return single(conf.resolve(k, t));
+			}
+
+			const Array* array(const Key& k) const {
+				return multi(conf.resolve(k, t));
+			}
+
+		private:
+			friend class Conf;
+
+			Conf&		conf;
+			const typename Conf::Table* t;
+			typename Conf::Slot* slot;
+
 		private:
-			std::vector<Value> vect;
+			Pin(const Pin&);
+			Pin& operator = (const Pin&);
 		};
 
+		// 节变化的通知, 全局键值的节名为""
+		typedef void (*Notify)(Conf* conf, const char* section, void* arg);
+
 	private:
-		typedef std::map<std::string, Array*>	KV;	// {key: [value1, value2, ...]}
+		// 条目、值和数组只使用自相对指针, 可以原样写入镜像
+		struct Entry {
+			Rel<const char>	sec;	// 全局键值的节名长度为0
+			size_t		seclen;
+			Rel<const char>	key;
+			size_t		keylen;
+			uint64_t	hash;	// 全路径"节.键"的哈希
+			Array		arr;
+		};
 
+		// include指令
+		struct Include {
+			std::string	pattern;
+			size_t		line;
+		};
 
-	public:
-		Conf(const char* filename) {
-			global = new KV();
-			sections = new std::map<std::string, KV*>();
-			cursec = global;
-			loaded = false;
+		// 解析结果: 值、行的拷贝都放在arena中, 条目按(节, 键)排序
+		// 从镜像加载时条目和索引直接指向镜像的映射
+		class Table {
+		public:
+			Table(): gen(0), ok(false), ents(NULL), nent(0), slots(NULL), mask(0), srchash(0),
+					map(NULL), maplen(0), fragment(false), cur(NULL), left(0) {
+			}
 
-			if (load(filename) == 0)
-				loaded = true;
-		}
+			~Table() {
+				for (size_t i = 0; i < parts.size(); i++)
+					delete parts[i];
 
-		bool loadOk() {
-			return loaded;
-		}
+				for (size_t i = 0; i < blocks.size(); i++)
+					::free(blocks[i]);
 
-		~Conf() {
-			for (typename std::map<std::string, Array*>::iterator it = global->begin(); it != global->end(); ++it) {
-				delete it->second;
+				if (map != NULL)
+					munmap(map, maplen);
 			}
-			delete global;
 
-			for (typename std::map<std::string, KV*>::iterator it = sections->begin(); it != sections->end(); ++it) {
-				for (typename std::map<std::string, Array*>::iterator iter = it->second->begin();
-						iter != it->second->end(); ++iter) {
-					delete iter->second;
+			// 按8字节对齐分配, 失败返回NULL
+			void* alloc(size_t n) {
+				n = (n + 7) & ~(size_t)7;
+				if (n > left) {
+					size_t cap = n > 65536 ? n : 65536;
+					char* b = (char*)::malloc(cap);
+					if (b == NULL)
+						return NULL;
+
+					try {
+						blocks.push_back(b);
+					} catch (std::bad_alloc& e) {
+						::free(b);
+						return NULL;
+					}
+
+					cur = b;
+					left = cap;
 				}
 
-				delete it->second;
+				void* p = cur;
+				cur += n;
+				left -= n;
+				return p;
 			}
 
-			delete sections;
-		}
-
-		void dump() {
-			const Array* array = NULL;
-			const Value* value = NULL;
-			for (typename std::map<std::string, Array*>::iterator it = global->begin(); it != global->end(); ++it) {
-				array = it->second;
-				size_t len = array->size();
-
-				std::cout << "{ \"" << it->first << "\" : [ ";
-				for (size_t i = 0; i < len; i++) {
-					value = array->at(i);
-
-					std::cout << "\"" << value->toString() << "\"";
-					if (i != len - 1)
-						std::cout << ", ";
+			char* copy(const char* s, size_t n) {
+				char* p = (char*)alloc(n + 1);
+				if (p != NULL) {
+					memcpy(p, s, n);
+					p[n] = '\0';
 				}
-				std::cout << " ] }" << std::endl;
 
+				return p;
 			}
 
-			for (typename std::map<std::string, KV*>::iterator it = sections->begin(); it != sections->end(); ++it) {
-				std:: cout << "{ \"" << it->first << "\" : " << std::endl;
-				for (typename std::map<std::string, Array*>::iterator iter = it->second->begin();
-						iter != it->second->end(); ++iter) {
-					array = iter->second;
-					size_t len = array->size();
+			// 为排好序的条目建立开放寻址的哈希索引, 装载率不超过1/2
+			bool index() {
+				size_t cap = 16;
+				while (cap < entbuf.size() * 2)
+					cap <<= 1;
+
+				try {
+					slotbuf.assign(cap, 0);
+				} catch (std::bad_alloc& e) {
+					return false;
+				}
+
+				ents = entbuf.empty() ? NULL : &entbuf[0];
+				nent = entbuf.size();
+				slots = &slotbuf[0];
+				mask = cap - 1;
+				for (size_t i = 0; i < entbuf.size(); i++) {
+					Entry& ent = entbuf[i];
+					uint64_t h = hash(0, ent.sec, ent.seclen);
+					if (ent.seclen > 0)
+						h = hash(h, ".", 1);
+					ent.hash = hash(h, ent.key, ent.keylen);
+
+					size_t j = ent.hash & mask;
+					while (slotbuf[j] != 0)
+						j = (j + 1) & mask;
+
+					slotbuf[j] = (uint32_t)(i + 1);
+				}
 
-					std:: cout << "\t{ \"" << iter->first << "\" : [ ";
-					for (size_t i = 0; i < len; i++) {
-						value = array->at(i);
+				return true;
+			}
 
-						std::cout << "\"" << value->toString() << "\"";
-						if (i != len - 1)
-							std::cout << ", ";
+			// 按全路径查找, 第一个'.'之前是节名, 没有'.'时查全局键值
+			// 返回条目下标加1, 不存在返回0
+			size_t find(const char* path, size_t len) const {
+				if (slots == NULL)
+					return 0;
+
+				const char* dot = (const char*)memchr(path, '.', len);
+				size_t seclen = dot == NULL ? 0 : dot - path;
+				uint64_t h = hash(0, path, len);
+
+				for (size_t j = h & mask; slots[j] != 0; j = (j + 1) & mask) {
+					const Entry& ent = ents[slots[j] - 1];
+					if (ent.hash != h || ent.seclen != seclen)
+						continue;
+
+					if (dot == NULL) {
+						if (ent.keylen == len && memcmp(ent.key, path, len) == 0)
+							return slots[j];
+					} else {
+						if (ent.keylen == len - seclen - 1 && memcmp(ent.sec, path, seclen) == 0
+								&& memcmp(ent.key, dot + 1, ent.keylen) == 0)
+							return slots[j];
 					}
-					std::cout << " ] }" << std::endl;
 				}
-				std::cout << "}" << std::endl;
+
+				return 0;
 			}
+
+		public:
+			uint32_t		gen;	// 快照代数, 从1开始
+			bool			ok;	// 加载成功
+			std::string		err;	// 加载失败的原因
+			const Entry*		ents;
+			size_t			nent;
+			const uint32_t*		slots;	// 条目下标加1, 0为空
+			size_t			mask;
+			uint64_t		srchash; // Lcache模式下源文件内容的哈希
+			void*			map;	// 源文件或镜像的映射
+			size_t			maplen;
+
+			std::vector<Entry>	entbuf;	// 解析文本时条目和索引的存储
+			std::vector<uint32_t>	slotbuf;
+
+			bool			fragment; // 被包含的片段, 不能再包含
+			std::vector<Include>	incs;	// 主文件中的include指令
+			std::vector<Table*>	parts;	// 片段的解析结果, 条目指向其中的内存
+
+		private:
+			std::vector<char*>	blocks;
+			char*			cur;
+			size_t			left;
+
+		private:
+			Table(const Table&);
+			Table& operator = (const Table&);
+		};
+
+	public:
+		// image为Lcache模式下镜像的路径, 默认为filename加".bin"
+		Conf(const char* filename, int mode = Lstream, const char* image = NULL): file(filename), mode(mode),
+				gens(1), epoch(1), watching(false), ifd(-1) {
+			img = image != NULL ? image : file + ".bin";
+
+			pthread_mutex_init(&wlock, NULL);
+			pthread_mutex_init(&olock, NULL);
+			pthread_key_create(&rkey, NULL);
+			memset(readers, 0, sizeof(readers));
+			over.epoch = 0;
+			over.used = 0;
+			overs = 0;
+
+			tab = new Table();
+			tab->gen = gens;
+			if (load(tab, filename, mode) == 0)
+				tab->ok = true;
+
+			lasterr = tab->err;
 		}
 
-		const Array* getArray(const char* path) {
-			const Array* array = NULL;
+		bool loadOk() {
+			return current()->ok;
+		}
 
-			if (!loaded)
-				return NULL;
+		// 最近一次加载失败的原因, 如"line 12: bad value '99999999999TB'"
+		std::string error() {
+			pthread_mutex_lock(&wlock);
+			std::string e = lasterr;
+			pthread_mutex_unlock(&wlock);
 
-			array = findArray(path);
-			if (array == NULL)
-				return NULL;
+			return e;
+		}
 
-			if (array->size() == 1)
-				return NULL;
+		~Conf() {
+			unwatch();
 
-			return array;
+			for (size_t i = 0; i < retired.size(); i++)
+				delete retired[i].t;
+			delete tab;
+
+			pthread_key_delete(rkey);
+			pthread_mutex_destroy(&olock);
+			pthread_mutex_destroy(&wlock);
+		}
+
+		void dump() {
+			Pin pin(*this);
+
+			const Entry* sec = NULL;
+			for (size_t i = 0; i < pin.t->nent; i++) {
+				const Entry* e = &pin.t->ents[i];
+				const char* indent = "";
+
+				if (e->seclen > 0) {
+					if (sec == NULL || !sameSection(sec, e)) {
+						if (sec != NULL)
+							std::cout << "}" << std::endl;
+
+						sec = e;
+						std::cout << "{ \"" << std::string(e->sec, e->seclen) << "\" : " << std::endl;
+					}
+
+					indent = "\t";
+				}
+
+				std::cout << indent << "{ \"" << std::string(e->key, e->keylen) << "\" : [ ";
+				for (size_t j = 0; j < e->arr.size(); j++) {
+					std::cout << "\"" << e->arr.at(j)->toString() << "\"";
+					if (j != e->arr.size() - 1)
+						std::cout << ", ";
+				}
+				std::cout << " ] }" << std::endl;
+			}
+
+			if (sec != NULL)
+				std::cout << "}" << std::endl;
+		}
+
+		// 以下查找不固定快照, 返回的指针在重新加载后可能失效
+		// 使用reload()或watch()时应通过Pin访问
+		const Array* getArray(const char* path) {
+			return multi(find(current(), path));
 		}
 
 		const Value* getValue(const char* path) {
-			const Array* array = NULL;
+			return single(find(current(), path));
+		}
 
-			if (!loaded)
-				return NULL;
+		Key key(const char* path) {
+			Key k;
 
-			array = findArray(path);
-			if (array == NULL)
-				return NULL;
+			k.conf = this;
+			k.path = path;
 
-			if (array->size() != 1)
-				return NULL;
+			Pin pin(*this);
+			resolve(k, pin.t);
 
-			return array->at(0);
+			return k;
 		}
 
-	private:
-		Conf(const Conf&);
-		Conf& operator = (const Conf&);
+		// 重新解析文件生成新快照并原子地替换, 解析失败时保留原快照并返回false
+		// 有变化的节会通知onChange登记的函数
+		bool reload() {
+			Table* t = new(std::nothrow) Table();
+			if (t == NULL)
+				return false;
 
-	private:
-		const Array* findArray(const char* path) {
-			const char *p = NULL;
-			const char *q = NULL;
-			const Array* array = NULL;
+			if (load(t, file.c_str(), mode) != 0) {
+				pthread_mutex_lock(&wlock);
+				lasterr = t->err;
+				pthread_mutex_unlock(&wlock);
 
-			if (path == NULL)
-				return NULL;
+				delete t;
+				return false;
+			}
 
-			p = strchr(path, '.');
-			if (p == NULL) {		// 从全局键值表查
-				p = path;		// q: NULL, p: key
-			} else {
-				q = path;		// q: section, p: key
-				p += 1;
+			std::vector<std::string> changed;
+			std::vector<Hook> notify;
+
+			pthread_mutex_lock(&wlock);
+			t->gen = ++gens;
+			t->ok = true;
+
+			Table* old = __atomic_exchange_n(&tab, t, __ATOMIC_SEQ_CST);
+			uint64_t e = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+
+			try {
+				diff(old, t, changed);
+				notify = hooks;
+				retired.push_back(Retired(old, e));
+			} catch (std::bad_alloc& ex) {
+				// 无法登记时等所有读者退出后直接回收
+				while (!quiescent(e))
+					sched_yield();
+				delete old;
 			}
 
-			if (q == NULL) {
-				typename std::map<std::string, Array*>::iterator it = global->find(std::string(p));
-				if (it != global->end())
-					array = it->second;
-			} else {
-				typename std::map<std::string, KV*>::iterator it = sections->find(std::string(q, p - q - 1));
-				if (it != sections->end()) {
-					typename std::map<std::string, Array*>::iterator iter = it->second->find(std::string(p));
-					if (iter != it->second->end())
-						array = iter->second;
+			reclaim();
+			pthread_mutex_unlock(&wlock);
+
+			for (size_t i = 0; i < changed.size(); i++) {
+				for (size_t j = 0; j < notify.size(); j++) {
+					if (notify[j].all || notify[j].sec == changed[i])
+						notify[j].fn(this, changed[i].c_str(), notify[j].arg);
 				}
 			}
 
-			return array;
+			return true;
 		}
 
-		int load(const char* filename) {
-			int err = 0;
+		// 登记节变化时的通知函数, section为NULL时任何节变化都会通知
+		void onChange(const char* section, Notify fn, void* arg) {
+			Hook h;
+			h.all = section == NULL;
+			h.sec = section == NULL ? "" : section;
+			h.fn = fn;
+			h.arg = arg;
+
+			pthread_mutex_lock(&wlock);
+			hooks.push_back(h);
+			pthread_mutex_unlock(&wlock);
+		}
 
-			char buff[N];
-			std::ifstream ifs;
+		// 用inotify监视文件, 文件被改写或替换后自动reload()
+		// Lmmap模式下文件应以改名的方式整体替换, 原地截断会使旧快照失效
+		// 只监视主文件, 包含的片段变化后需调用reload()
+		bool watch() {
+			if (watching)
+				return true;
 
-			ifs.open(filename, std::ifstream::in);
-			if (ifs.fail())			// 打开文件失败
-				err = -1;
+			size_t pos = file.rfind('/');
+			std::string dir = pos == std::string::npos ? "." : (pos == 0 ? "/" : file.substr(0, pos));
+			base = pos == std::string::npos ? file : file.substr(pos + 1);
 
-			while (ifs.good()) {
-				ifs.getline(buff, N);	// 结尾为'\0'
-				if (!parse(buff)) {
-					err = -2;
-					break;
-				}
+			ifd = inotify_init1(IN_CLOEXEC);
+			if (ifd < 0)
+				return false;
+
+			if (inotify_add_watch(ifd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0 || pipe(stop) != 0) {
+				close(ifd);
+				ifd = -1;
+				return false;
 			}
 
-			ifs.close();
+			if (pthread_create(&wtid, NULL, watcher, this) != 0) {
+				close(ifd);
+				close(stop[0]);
+				close(stop[1]);
+				ifd = -1;
+				return false;
+			}
 
-			return err;
+			watching = true;
+			return true;
 		}
 
-		// 格式错误返回false
-		bool parse(char* buff) {
-			char* b = NULL;
-			char* p = NULL;
-			char* k = NULL;
-			char* v = NULL;
-			char* t = NULL;
+		void unwatch() {
+			if (!watching)
+				return;
 
-			Conf::Array* array = NULL;
+			ssize_t n = write(stop[1], "x", 1);
+			(void)n;
+			pthread_join(wtid, NULL);
 
-			// 跳过空行
-			if (*buff == '\0')
-				return true;
+			close(ifd);
+			close(stop[0]);
+			close(stop[1]);
+			ifd = -1;
+			watching = false;
+		}
 
-			// 跳过空白字符
-			//for (p = buff; *p != '\0' && isspace(*p); p++);
-			//b = p;
+	private:
+		Conf(const Conf&);
+		Conf& operator = (const Conf&);
 
-			// 跳过注释行
-			if (*buff == '#') {
-				return true;
+	private:
+		struct Hook {
+			bool		all;
+			std::string	sec;
+			Notify		fn;
+			void*		arg;
+		};
+
+		struct Retired {
+			Retired(Table* t, uint64_t e): t(t), epoch(e) {
 			}
 
-			// 非空白字符开始的行可能是全局键值
-			if (!isspace(*buff))
-				cursec = global;
+			Table*		t;
+			uint64_t	epoch;	// 替换后的纪元, 所有读者的纪元都不小于它时可以回收
+		};
 
-			// 跳过空白字符
-			for (p = buff; *p != '\0' && isspace(*p); p++);
-			b = p;
+		// 每个Pin在生命期内占用一个槽, 记录固定快照时的纪元, 0表示没有固定
+		struct Slot {
+			uint64_t	epoch;
+			int		used;
+		} __attribute__((aligned(64)));
 
-			// 去掉行尾的注释
-			p = strchr(b, '#');
-			if (p != NULL)
-				*p = '\0';
+		static const size_t Rmax = 128;
 
-			if (*b == '[') {		// 新的节
-				p = strrchr(b, ']');
-				if (p == NULL)
-					return false;
+		const Table* current() const {
+			return __atomic_load_n(&tab, __ATOMIC_ACQUIRE);
+		}
 
-				// 提取节名
-				b += 1;
-				*p = '\0';
+		// 槽都被占用时s为NULL, 使用共享的溢出槽
+		const Table* pin(Slot*& s) {
+			s = claim();
+			if (s != NULL) {
+				__atomic_store_n(&s->epoch, __atomic_load_n(&epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+				return __atomic_load_n(&tab, __ATOMIC_SEQ_CST);
+			}
 
-				// 节名为空
-				if (b == p)
-					return true;
+			// 溢出的读者共用一个槽, 纪元取其中最早的, 直到全部退出
+			pthread_mutex_lock(&olock);
+			if (overs++ == 0)
+				__atomic_store_n(&over.epoch, __atomic_load_n(&epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+			const Table* t = __atomic_load_n(&tab, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&olock);
 
-				t = trimSpace(b);
-				if (*t == '\0')
-					return true;
+			return t;
+		}
 
-				// 创建节
-				try {
-					KV* kv = new KV();
-					sections->insert(std::pair<std::string, KV*>(std::string(t), kv));
-					cursec = kv;
-				} catch (std::bad_alloc& e) {
-					return false;
-				}
+		void unpin(Slot* s) {
+			if (s != NULL) {
+				__atomic_store_n(&s->epoch, 0, __ATOMIC_RELEASE);
+				__atomic_store_n(&s->used, 0, __ATOMIC_RELEASE);
+				return;
+			}
 
-			} else { // 键值对
-				p = strchr(b, '=');
-				if (p == NULL)
-					return true;
+			pthread_mutex_lock(&olock);
+			if (--overs == 0)
+				__atomic_store_n(&over.epoch, 0, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&olock);
+		}
 
-				// 分离键值
-				*p = '\0';
+		// 认领一个空闲的槽, 先试本线程上次用过的, 都被占用时返回NULL
+		Slot* claim() {
+			Slot* last = (Slot*)pthread_getspecific(rkey);
+			size_t first = last == NULL ? 0 : last - readers;
+
+			for (size_t k = 0; k < Rmax; k++) {
+				Slot* s = &readers[(first + k) % Rmax];
+				int f = 0;
+				if (__atomic_load_n(&s->used, __ATOMIC_RELAXED) == 0
+						&& __atomic_compare_exchange_n(&s->used, &f, 1, false,
+							__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+					if (s != last)
+						pthread_setspecific(rkey, s);
+					return s;
+				}
+			}
 
-				k = trimSpace(b);
-				v = trimSpace(p + 1);
+			return NULL;
+		}
 
-				// 键为空
-				if (*k == '\0')
-					return true;
+		// 没有读者还停留在纪元e之前
+		bool quiescent(uint64_t e) {
+			for (size_t i = 0; i < Rmax; i++) {
+				uint64_t r = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+				if (r != 0 && r < e)
+					return false;
+			}
 
-				// 准备存值
-				if (*v == '[') { // 值为列表
-					p = strrchr(v, ']');
-					if (p == NULL)
-						return false;
+			uint64_t r = __atomic_load_n(&over.epoch, __ATOMIC_SEQ_CST);
+			return r == 0 || r >= e;
+		}
 
-					// 提取列表
-					v = v + 1;
-					*p = '\0';
+		// 回收不再被读者固定的旧快照, 需持有wlock
+		void reclaim() {
+			size_t j = 0;
+			for (size_t i = 0; i < retired.size(); i++) {
+				if (quiescent(retired[i].epoch))
+					delete retired[i].t;
+				else
+					retired[j++] = retired[i];
+			}
 
-					// 列表为空
-					if (v == p)
-						return true;
+			retired.resize(j, Retired(NULL, 0));
+		}
 
-					t = trimSpace(v);
-					if (*t == '\0')
-						return true;
+		static void* watcher(void* arg) {
+			Conf* c = (Conf*)arg;
+			char buf[4096] __attribute__((aligned(8)));
+			struct pollfd fds[2];
 
-					try {
-						array = new Array();
-					} catch (std::bad_alloc& e) {
-						return false;
-					}
+			fds[0].fd = c->ifd;
+			fds[0].events = POLLIN;
+			fds[1].fd = c->stop[0];
+			fds[1].events = POLLIN;
 
-					// 提取列表值
-					b = v;
-					do {
-						p = strchr(b, ',');
-						if (p == NULL) {
-							t = trimSpace(b);
-							if (*t != '\0')
-								array->add(Value(t));
-
-						} else {
-							*p = '\0';
-							t = trimSpace(b);
-							if (*t != '\0')
-								array->add(Value(t));
-
-							b = p + 1;
-						}
-					} while (p != NULL);
-				} else {
-					// 值为空
-					if (*v == '\0')
-						return true;
+			while (true) {
+				int n = poll(fds, 2, 1000);
+				if (n < 0 && errno == EINTR)
+					continue;
 
-					try {
-						array = new Array();
-					} catch (std::bad_alloc& e) {
-						return false;
-					}
+				if (n < 0 || fds[1].revents != 0)
+					break;
 
-					t = trimSpace(b);
-					if (*t != '\0')
-						array->add(Value(v));
+				if (n == 0) {	// 超时, 回收滞留的旧快照
+					pthread_mutex_lock(&c->wlock);
+					c->reclaim();
+					pthread_mutex_unlock(&c->wlock);
+					continue;
 				}
 
-				if (array != NULL) {
-					if (array->size() == 0) {
-						delete array;
-						return true;
-					}
+				ssize_t len = read(c->ifd, buf, sizeof(buf));
+				bool hit = false;
+				for (char* p = buf; len > 0 && p < buf + len; ) {
+					struct inotify_event* ev = (struct inotify_event*)p;
+					if (ev->len > 0 && c->base == ev->name)
+						hit = true;
 
-					cursec->insert(std::pair<std::string, Array*>(std::string(k), array));
+					p += sizeof(struct inotify_event) + ev->len;
 				}
+
+				if (hit)
+					c->reload();
 			}
 
-			return true;
+			return NULL;
 		}
 
-		char* trimSpace(char* s) {
-			char* p = NULL;
-			char* q = NULL;
-			size_t len = strlen(s);
+		// 用快照代数验证Key缓存的下标, 不一致时重新查找
+		const Array* resolve(const Key& k, const Table* t) {
+			uint64_t w = __atomic_load_n(&k.cache, __ATOMIC_RELAXED);
+			size_t i = (size_t)(uint32_t)w;
 
-			if (len <= 0)
-				return s;
+			if ((uint32_t)(w >> 32) != t->gen) {
+				i = t->find(k.path.data(), k.path.size());
+				w = ((uint64_t)t->gen << 32) | (uint32_t)i;
+				__atomic_store_n(&k.cache, w, __ATOMIC_RELAXED);
+			}
 
-			for (p = s; *p != '\0' && (isspace(*p) || *p == '"' || *p == '\''); p++);
+			return i == 0 ? NULL : &t->ents[i - 1].arr;
+		}
 
-			for (q = s + len - 1; q != p; q--) {
-				if (!isspace(*q) && *q != '"' && *q != '\'') {
-					*(q + 1) = '\0';
-					break;
+		const Array* find(const Table* t, const char* path) {
+			if (path == NULL)
+				return NULL;
+
+			size_t i = t->find(path, strlen(path));
+			return i == 0 ? NULL : &t->ents[i - 1].arr;
+		}
+
+		static const Value* single(const Array* array) {
+			if (array == NULL || array->size() != 1)
+				return NULL;
+
+			return array->at(0);
+		}
+
+		static const Array* multi(const Array* array) {
+			if (array == NULL || array->size() == 1)
+				return NULL;
+
+			return array;
+		}
+
+		// 比较两个快照, 按顺序记录有变化的节名
+		static void diff(const Table* a, const Table* b, std::vector<std::string>& changed) {
+			size_t i = 0;
+			size_t j = 0;
+
+			while (i < a->nent || j < b->nent) {
+				const Entry* x = i < a->nent ? &a->ents[i] : NULL;
+				const Entry* y = j < b->nent ? &b->ents[j] : NULL;
+				const Entry* d = NULL;
+
+				int c = x == NULL ? 1 : (y == NULL ? -1 : compare(*x, *y));
+				if (c < 0) {
+					d = x;
+					i++;
+				} else if (c > 0) {
+					d = y;
+					j++;
+				} else {
+					if (!equal(x->arr, y->arr))
+						d = x;
+					i++;
+					j++;
 				}
-			}
 
-			return p;
+				if (d != NULL && (changed.empty() || changed.back().size() != d->seclen
+							|| memcmp(changed.back().data(), d->sec, d->seclen) != 0))
+					changed.push_back(std::string(d->sec, d->seclen));
+			}
 		}
 
-	private:
-		KV* global;
-		std::map<std::string, KV*>* sections;
-		KV* cursec;
+		static bool equal(const Array& a, const Array& b) {
+			if (a.size() != b.size())
+				return false;
 
-		bool loaded;
-	};
+			for (size_t i = 0; i < a.size(); i++) {
+				if (a.at(i)->size() != b.at(i)->size()
+						|| memcmp(a.at(i)->data(), b.at(i)->data(), a.at(i)->size()) != 0)
+					return false;
+			}
+
+			return true;
+		}
+
+		int load(Table* t, const char* filename, int mode) {
+			int err = 0;
+			std::vector<std::string> names;	// 包含的片段, 与t->parts一一对应
+
+			if (mode == Lcache) {
+				err = mapFile(t, filename);
+				if (err != 0)
+					return err;
+
+				// 片段的文件名和内容也计入哈希, 任何片段变化都使镜像失效
+				t->srchash = digest(t->map, t->maplen);
+				err = scanIncludes(t, (const char*)t->map, t->maplen);
+				if (err == 0)
+					err = expand(t, filename, names);
+				if (err == 0)
+					err = mapParts(t, names);
+				if (err != 0)
+					return err;
+
+				// 镜像有效时直接使用
+				if (loadImage(t)) {
+					dropParts(t);
+					return 0;
+				}
+
+				// 解析时重新收集include指令
+				t->incs.clear();
+				err = parseText(t, (const char*)t->map, t->maplen);
+			} else if (mode == Lmmap) {
+				err = mapFile(t, filename);
+				if (err == 0)
+					err = parseText(t, (const char*)t->map, t->maplen);
+			} else {
+				err = loadStream(t, filename);
+			}
+
+			if (err == 0 && names.empty())
+				err = expand(t, filename, names);
+			if (err == 0)
+				err = loadParts(t, names, mode);
+			if (err != 0)
+				return err;
+
+			// 排序后去掉重复的键, 保留先出现的
+			try {
+				std::stable_sort(t->entbuf.begin(), t->entbuf.end(), less);
+				t->entbuf.erase(std::unique(t->entbuf.begin(), t->entbuf.end(), same), t->entbuf.end());
+			} catch (std::bad_alloc& e) {
+				t->err = "out of memory";
+				return -2;
+			}
+
+			err = merge(t, names);
+			if (err != 0)
+				return err;
+
+			if (!t->index()) {
+				t->err = "out of memory";
+				return -2;
+			}
+
+			// 写镜像失败不影响加载
+			if (mode == Lcache)
+				saveImage(t);
+
+			return 0;
+		}
+
+		// 只找出行首的include指令, Lcache模式下在使用镜像之前确定片段
+		int scanIncludes(Table* t, const char* p, size_t size) {
+			Cursor cur = {NULL, 0, 0};
+			const char* end = p + size;
+			const char* pat;
+			size_t len;
+
+			for (const char* b = p; b < end; b++) {
+				const char* e = (const char*)memchr(b, '\n', end - b);
+				if (e == NULL)
+					e = end;
+
+				cur.line++;
+				if (*b == 'i') {
+					const char* c = b + Scan::findAny(b, e - b, "#", 1);
+					if (directive(b, c, &pat, &len) && !include(t, cur, pat, len))
+						return -2;
+				}
+
+				b = e;
+			}
+
+			return 0;
+		}
+
+		// 按include指令展开片段的文件名, 相对路径相对于filename所在的目录
+		// 每个模式的结果按文件名排序, 同一文件只取第一次出现; 没有通配符的路径必须存在
+		int expand(Table* t, const char* filename, std::vector<std::string>& names) {
+			const char* slash = strrchr(filename, '/');
+			std::string dir = slash == NULL ? std::string() : std::string(filename, slash - filename + 1);
+
+			for (size_t i = 0; i < t->incs.size(); i++) {
+				const Include& inc = t->incs[i];
+				std::string pat = inc.pattern[0] == '/' ? inc.pattern : dir + inc.pattern;
+
+				glob_t g;
+				int r = glob(pat.c_str(), GLOB_NOMAGIC, NULL, &g);
+				if (r == GLOB_NOMATCH)
+					continue;
+
+				if (r != 0) {
+					Cursor cur = {NULL, 0, inc.line};
+					globfree(&g);
+					fail(t, cur, "cannot expand include", inc.pattern.data(), inc.pattern.size());
+					return -1;
+				}
+
+				try {
+					for (size_t k = 0; k < g.gl_pathc; k++) {
+						std::string name = g.gl_pathv[k];
+						if (name != filename && std::find(names.begin(), names.end(), name) == names.end())
+							names.push_back(name);
+					}
+				} catch (std::bad_alloc& e) {
+					globfree(&g);
+					t->err = "out of memory";
+					return -2;
+				}
+
+				globfree(&g);
+			}
+
+			return 0;
+		}
+
+		// 为每个片段建立一个Table, 已建立时不变
+		bool addParts(Table* t, size_t n) {
+			try {
+				t->parts.reserve(n);
+				while (t->parts.size() < n) {
+					Table* p = new Table();
+					p->fragment = true;
+					t->parts.push_back(p);
+				}
+			} catch (std::bad_alloc& e) {
+				t->err = "out of memory";
+				return false;
+			}
+
+			return true;
+		}
+
+		void dropParts(Table* t) {
+			for (size_t i = 0; i < t->parts.size(); i++)
+				delete t->parts[i];
+
+			t->parts.clear();
+		}
+
+		// Lcache模式下先映射所有片段, 计入源文件的哈希
+		int mapParts(Table* t, const std::vector<std::string>& names) {
+			if (names.empty())
+				return 0;
+
+			if (!addParts(t, names.size()))
+				return -2;
+
+			for (size_t i = 0; i < names.size(); i++) {
+				Table* p = t->parts[i];
+				if (mapFile(p, names[i].c_str()) != 0) {
+					t->err = p->err;
+					return -1;
+				}
+
+				t->srchash = (t->srchash ^ digest(names[i].data(), names[i].size())) * 0xff51afd7ed558ccdULL;
+				t->srchash = (t->srchash ^ digest(p->map, p->maplen)) * 0xc4ceb9fe1a85ec53ULL;
+			}
+
+			return 0;
+		}
+
+		struct Job {
+			Conf*					conf;
+			Table*					t;
+			const std::vector<std::string>*		names;
+			int					mode;
+			size_t					next;	// 下一个待解析的片段
+			std::vector<int>			errs;
+		};
+
+		static void* parser(void* arg) {
+			Job* j = (Job*)arg;
+			size_t n = j->t->parts.size();
+			size_t i;
+
+			while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < n)
+				j->errs[i] = j->conf->loadPart(j->t->parts[i], (*j->names)[i].c_str(), j->mode);
+
+			return NULL;
+		}
+
+		// 在工作线程上解析一个片段, 条目排序去重后等待合并
+		int loadPart(Table* p, const char* name, int mode) {
+			int err = 0;
+
+			if (mode == Lstream) {
+				err = loadStream(p, name);
+			} else {
+				if (p->map == NULL)
+					err = mapFile(p, name);
+				if (err == 0)
+					err = parseText(p, (const char*)p->map, p->maplen);
+			}
+
+			if (err != 0)
+				return err;
+
+			try {
+				std::stable_sort(p->entbuf.begin(), p->entbuf.end(), less);
+				p->entbuf.erase(std::unique(p->entbuf.begin(), p->entbuf.end(), same), p->entbuf.end());
+			} catch (std::bad_alloc& e) {
+				p->err = "out of memory";
+				return -2;
+			}
+
+			return 0;
+		}
+
+		// 片段分给不超过CPU数的线程并行解析, 调用者也参与
+		// 多个片段出错时报告文件名排在最前的一个
+		int loadParts(Table* t, const std::vector<std::string>& names, int mode) {
+			if (names.empty())
+				return 0;
+
+			if (!addParts(t, names.size()))
+				return -2;
+
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			size_t threads = cpus > 1 ? (size_t)cpus : 1;
+			if (threads > names.size())
+				threads = names.size();
+
+			Job job;
+			std::vector<pthread_t> tids;
+			job.conf = this;
+			job.t = t;
+			job.names = &names;
+			job.mode = mode;
+			job.next = 0;
+
+			try {
+				job.errs.assign(names.size(), 0);
+				tids.reserve(threads);
+			} catch (std::bad_alloc& e) {
+				t->err = "out of memory";
+				return -2;
+			}
+
+			for (size_t i = 1; i < threads; i++) {
+				pthread_t tid;
+				if (pthread_create(&tid, NULL, parser, &job) == 0)
+					tids.push_back(tid);
+			}
+
+			parser(&job);
+			for (size_t i = 0; i < tids.size(); i++)
+				pthread_join(tids[i], NULL);
+
+			for (size_t i = 0; i < names.size(); i++) {
+				int err = job.errs[i];
+				if (err == 0)
+					continue;
+
+				// 打开失败的原因中已有文件名
+				t->err = err == -1 ? t->parts[i]->err : names[i] + ": " + t->parts[i]->err;
+				return err;
+			}
+
+			return 0;
+		}
+
+		struct Tagged {
+			Entry	ent;
+			int	from;	// 片段的下标, 主文件为-1
+		};
+
+		static bool lessTagged(const Tagged& a, const Tagged& b) {
+			return compare(a.ent, b.ent) < 0;
+		}
+
+		// 合并主文件和片段的条目, 各部分都已排序去重
+		// 主文件的键覆盖片段中的同名键, 主文件没有而多个片段都有的键是冲突
+		int merge(Table* t, const std::vector<std::string>& names) {
+			if (t->parts.empty())
+				return 0;
+
+			try {
+				size_t total = t->entbuf.size();
+				for (size_t i = 0; i < t->parts.size(); i++)
+					total += t->parts[i]->entbuf.size();
+
+				// 主文件在前, 片段按文件名顺序, 稳定排序后同名键也保持这个顺序
+				std::vector<Tagged> all(total);
+				size_t k = 0;
+				for (size_t j = 0; j < t->entbuf.size(); j++, k++) {
+					all[k].ent = t->entbuf[j];
+					all[k].from = -1;
+				}
+
+				for (size_t i = 0; i < t->parts.size(); i++) {
+					const std::vector<Entry>& ents = t->parts[i]->entbuf;
+					for (size_t j = 0; j < ents.size(); j++, k++) {
+						all[k].ent = ents[j];
+						all[k].from = (int)i;
+					}
+				}
+
+				std::stable_sort(all.begin(), all.end(), lessTagged);
+
+				std::vector<Entry> out;
+				out.reserve(total);
+				for (size_t i = 0; i < all.size(); ) {
+					size_t j = i + 1;
+					while (j < all.size() && same(all[i].ent, all[j].ent))
+						j++;
+
+					if (all[i].from >= 0 && j - i > 1) {
+						const Entry& ent = all[i].ent;
+						std::string path(ent.sec, ent.seclen);
+						if (ent.seclen > 0)
+							path += ".";
+						path.append(ent.key, ent.keylen);
+
+						t->err = "key '" + path + "' defined in both " + names[all[i].from]
+							+ " and " + names[all[i + 1].from];
+						return -2;
+					}
+
+					out.push_back(all[i].ent);
+					i = j;
+				}
+
+				t->entbuf.swap(out);
+			} catch (std::bad_alloc& e) {
+				t->err = "out of memory";
+				return -2;
+			}
+
+			return 0;
+		}
+
+		int loadStream(Table* t, const char* filename) {
+			int err = 0;
+
+			char buff[N];
+			std::ifstream ifs;
+			Cursor cur = {NULL, 0, 0};
+
+			ifs.open(filename, std::ifstream::in);
+			if (ifs.fail()) {		// 打开文件失败
+				t->err = std::string("cannot open ") + filename;
+				err = -1;
+			}
+
+			while (ifs.good()) {
+				ifs.getline(buff, N);	// 结尾为'\0'
+				cur.line++;
+
+				// 跳过空行和注释行, 其余的行拷贝一份, 值指向拷贝
+				size_t n = strlen(buff);
+				if (n == 0 || *buff == '#')
+					continue;
+
+				char* line = t->copy(buff, n);
+				if (line == NULL || !parse(t, line, n, cur)) {
+					if (line == NULL)
+						t->err = "out of memory";
+					err = -2;
+					break;
+				}
+			}
+
+			ifs.close();
+
+			return err;
+		}
+
+		// 只读映射整个文件, 空文件不映射
+		int mapFile(Table* t, const char* filename) {
+			struct stat st;
+
+			t->err = std::string("cannot open ") + filename;
+			int fd = open(filename, O_RDONLY);
+			if (fd < 0)
+				return -1;
+
+			if (fstat(fd, &st) != 0) {
+				close(fd);
+				return -1;
+			}
+
+			t->err.clear();
+
+			size_t size = (size_t)st.st_size;
+			if (size == 0) {
+				close(fd);
+				return 0;
+			}
+
+			void* m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (m == MAP_FAILED) {
+				t->err = std::string("cannot map ") + filename;
+				return -1;
+			}
+
+			t->map = m;
+			t->maplen = size;
+			return 0;
+		}
+
+		int parseText(Table* t, const char* p, size_t size) {
+			Cursor cur = {NULL, 0, 0};
+
+			if (size == 0)
+				return 0;
+
+			madvise((void*)p, size, MADV_SEQUENTIAL);
+
+			// 一次扫描出一批行尾, 逐行解析
+			size_t offs[256];
+			size_t pos = 0;
+			while (pos < size) {
+				size_t base = pos;
+				size_t c = Scan::lines(p + base, size - base, offs, 256);
+
+				for (size_t i = 0; i < c; i++) {
+					size_t end = base + offs[i];
+					cur.line++;
+					if (!parse(t, p + pos, end - pos, cur))
+						return -2;
+
+					pos = end + 1;
+				}
+
+				if (c < 256)
+					break;
+			}
+
+			// 最后一行没有换行符
+			cur.line++;
+			if (pos < size && !parse(t, p + pos, size - pos, cur))
+				return -2;
+
+			return 0;
+		}
+
+		// 镜像格式(版本1), 各部分按8字节对齐:
+		// Image | Entry[nent] | uint32_t slots[nslot] | Value[] | int64_t[] | double[] | 字符串
+		// 所有引用都是自相对指针, 映射后直接使用
+		struct Image {
+			char		magic[8];	// "SMPCONF"
+			uint32_t	version;
+			uint32_t	entsize;	// sizeof(Entry), 不同平台/编译选项的布局不能混用
+			uint32_t	valsize;	// sizeof(Value)
+			uint32_t	hdrsize;
+			uint64_t	srchash;	// 源文件内容的哈希
+			uint64_t	srcsize;
+			uint64_t	size;		// 镜像总长度
+			uint64_t	nent;
+			uint64_t	nslot;
+			uint64_t	entoff;
+			uint64_t	slotoff;
+			uint64_t	sum;		// hdrsize之后所有内容的哈希
+		};
+
+		static const uint32_t Iversion = 1;
+
+		static size_t align8(size_t n) {
+			return (n + 7) & ~(size_t)7;
+		}
+
+		// 每次处理8字节的64位哈希, 用于校验文件内容
+		static uint64_t digest(const void* data, size_t n) {
+			const unsigned char* p = (const unsigned char*)data;
+			uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+			uint64_t w;
+
+			for (; n >= 8; p += 8, n -= 8) {
+				memcpy(&w, p, 8);
+				h = (h ^ w) * 0xff51afd7ed558ccdULL;
+				h ^= h >> 32;
+			}
+
+			w = 0;
+			memcpy(&w, p, n);
+			h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+			h ^= h >> 29;
+
+			return h;
+		}
+
+		// 镜像与源文件匹配且完整时替换t中源文件的映射, 否则返回false
+		bool loadImage(Table* t) {
+			struct stat st;
+
+			int fd = open(img.c_str(), O_RDONLY);
+			if (fd < 0)
+				return false;
+
+			if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Image)) {
+				close(fd);
+				return false;
+			}
+
+			size_t size = (size_t)st.st_size;
+			void* m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (m == MAP_FAILED)
+				return false;
+
+			const char* base = (const char*)m;
+			const Image* h = (const Image*)m;
+			bool ok = memcmp(h->magic, "SMPCONF", 8) == 0 && h->version == Iversion
+				&& h->entsize == sizeof(Entry) && h->valsize == sizeof(Value)
+				&& h->hdrsize == sizeof(Image) && h->size == size
+				&& h->srchash == t->srchash && h->srcsize == t->maplen
+				&& h->nslot >= 16 && (h->nslot & (h->nslot - 1)) == 0 && h->nent < h->nslot
+				&& h->entoff == align8(sizeof(Image)) && h->entoff + h->nent * sizeof(Entry) <= h->slotoff
+				&& h->slotoff + h->nslot * sizeof(uint32_t) <= size
+				&& digest(base + h->hdrsize, size - h->hdrsize) == h->sum;
+
+			if (!ok) {
+				munmap(m, size);
+				return false;
+			}
+
+			// 不再需要源文件
+			if (t->map != NULL)
+				munmap(t->map, t->maplen);
+
+			t->map = m;
+			t->maplen = size;
+			t->ents = (const Entry*)(base + h->entoff);
+			t->nent = h->nent;
+			t->slots = (const uint32_t*)(base + h->slotoff);
+			t->mask = h->nslot - 1;
+			return true;
+		}
+
+		// 把解析好的快照写成镜像, 先写临时文件再改名, 多个进程同时写也不会读到半个镜像
+		bool saveImage(const Table* t) {
+			size_t nval = 0;
+			size_t nint = 0;
+			size_t nflt = 0;
+			size_t nstr = 0;
+
+			for (size_t i = 0; i < t->nent; i++) {
+				const Entry& e = t->ents[i];
+				if (i == 0 || !sameSection(&t->ents[i - 1], &e))
+					nstr += e.seclen;
+				nstr += e.keylen;
+
+				nval += e.arr.n;
+				nint += e.arr.ints() != NULL ? e.arr.n : 0;
+				nflt += e.arr.floats() != NULL ? e.arr.n : 0;
+				for (size_t j = 0; j < e.arr.n; j++)
+					nstr += e.arr.vals[j].n;
+			}
+
+			size_t nslot = t->mask + 1;
+			size_t entoff = align8(sizeof(Image));
+			size_t slotoff = align8(entoff + t->nent * sizeof(Entry));
+			size_t valoff = align8(slotoff + nslot * sizeof(uint32_t));
+			size_t intoff = align8(valoff + nval * sizeof(Value));
+			size_t fltoff = intoff + nint * sizeof(int64_t);
+			size_t stroff = fltoff + nflt * sizeof(double);
+			size_t size = align8(stroff + nstr);
+
+			std::vector<char> buf;
+			try {
+				buf.assign(size, 0);
+			} catch (std::bad_alloc& e) {
+				return false;
+			}
+
+			char* base = &buf[0];
+			Entry* ents = (Entry*)(base + entoff);
+			Value* vals = (Value*)(base + valoff);
+			int64_t* ints = (int64_t*)(base + intoff);
+			double* flts = (double*)(base + fltoff);
+			char* strs = base + stroff;
+
+			memcpy(base + slotoff, t->slots, nslot * sizeof(uint32_t));
+
+			for (size_t i = 0; i < t->nent; i++) {
+				const Entry& src = t->ents[i];
+				Entry* e = new (&ents[i]) Entry();
+
+				if (i > 0 && sameSection(&t->ents[i - 1], &src)) {
+					e->sec = (const char*)ents[i - 1].sec;
+				} else {
+					if (src.seclen != 0)
+						memcpy(strs, src.sec, src.seclen);
+					e->sec = src.seclen > 0 ? strs : NULL;
+					strs += src.seclen;
+				}
+				e->seclen = src.seclen;
+
+				memcpy(strs, src.key, src.keylen);
+				e->key = strs;
+				e->keylen = src.keylen;
+				strs += src.keylen;
+				e->hash = src.hash;
+
+				e->arr.n = src.arr.n;
+				e->arr.vals = vals;
+				for (size_t j = 0; j < src.arr.n; j++) {
+					const Value& sv = src.arr.vals[j];
+					Value* v = new (vals++) Value(sv);
+
+					memcpy(strs, sv.data(), sv.n);
+					v->s = strs;
+					strs += sv.n;
+				}
+
+				if (src.arr.ints() != NULL) {
+					memcpy(ints, src.arr.ints(), src.arr.n * sizeof(int64_t));
+					e->arr.is = ints;
+					ints += src.arr.n;
+				}
+
+				if (src.arr.floats() != NULL) {
+					memcpy(flts, src.arr.floats(), src.arr.n * sizeof(double));
+					e->arr.fs = flts;
+					flts += src.arr.n;
+				}
+			}
+
+			Image* h = (Image*)base;
+			memcpy(h->magic, "SMPCONF", 8);
+			h->version = Iversion;
+			h->entsize = sizeof(Entry);
+			h->valsize = sizeof(Value);
+			h->hdrsize = sizeof(Image);
+			h->srchash = t->srchash;
+			h->srcsize = t->maplen;
+			h->size = size;
+			h->nent = t->nent;
+			h->nslot = nslot;
+			h->entoff = entoff;
+			h->slotoff = slotoff;
+			h->sum = digest(base + sizeof(Image), size - sizeof(Image));
+
+			char tmp[32];
+			snprintf(tmp, sizeof(tmp), ".%ld.tmp", (long)getpid());
+			std::string path = img + tmp;
+
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return false;
+
+			size_t off = 0;
+			while (off < size) {
+				ssize_t n = write(fd, base + off, size - off);
+				if (n <= 0) {
+					if (n < 0 && errno == EINTR)
+						continue;
+					break;
+				}
+				off += (size_t)n;
+			}
+
+			close(fd);
+			if (off != size || rename(path.c_str(), img.c_str()) != 0) {
+				unlink(path.c_str());
+				return false;
+			}
+
+			return true;
+		}
+
+		// 当前所在的节
+		struct Cursor {
+			const char*	sec;
+			size_t		seclen;
+			size_t		line;	// 当前行号, 用于报错
+		};
+
+		// 解析一行[b, b + n), 不修改行的内容, 格式错误返回false
+		bool parse(Table* table, const char* b, size_t n, Cursor& cur) {
+			const char* e = b + n;
+			const char* p = NULL;
+			const char* t = NULL;
+			size_t len = 0;
+
+			// 跳过空行和注释行
+			if (n == 0 || *b == '#')
+				return true;
+
+			// 非空白字符开始的行可能是全局键值
+			if (!isspace(*b)) {
+				cur.sec = NULL;
+				cur.seclen = 0;
+			}
+
+			// 跳过空白字符
+			const char* s = b;
+			while (b < e && isspace(*b))
+				b++;
+
+			// 去掉行尾的注释
+			e = b + Scan::findAny(b, e - b, "#", 1);
+
+			if (b == s && directive(b, e, &p, &len)) {	// 行首的include指令
+				if (table->fragment)
+					return fail(table, cur, "nested include", b, e - b);
+
+				return include(table, cur, p, len);
+			}
+
+			if (b < e && *b == '[') {	// 新的节
+				p = rfind(b, e, ']');
+				if (p == NULL)
+					return fail(table, cur, "missing ']'", b, e - b);
+
+				// 节名为空
+				t = trim(b + 1, p, &len);
+				if (len == 0)
+					return true;
+
+				cur.sec = t;
+				cur.seclen = len;
+
+			} else { // 键值对
+				p = (const char*)memchr(b, '=', e - b);
+				if (p == NULL)
+					return true;
+
+				Entry ent;
+				ent.sec = cur.sec;
+				ent.seclen = cur.seclen;
+				ent.hash = 0;
+				ent.key = trim(b, p, &ent.keylen);
+
+				// 键为空
+				if (ent.keylen == 0)
+					return true;
+
+				const char* v = trim(p + 1, e, &len);
+				const char* ve = v + len;
+
+				// 值为空
+				if (len == 0)
+					return true;
+
+				if (*v == '[') {	// 值为列表
+					p = rfind(v, ve, ']');
+					if (p == NULL)
+						return fail(table, cur, "missing ']'", v, len);
+
+					// 列表为空
+					v += 1;
+					ve = p;
+					trim(v, ve, &len);
+					if (len == 0)
+						return true;
+
+					// 按逗号个数预留空间
+					size_t cnt = 1;
+					for (p = v; (p = (const char*)memchr(p, ',', ve - p)) != NULL; p++)
+						cnt++;
+
+					Value* vals = (Value*)table->alloc(cnt * sizeof(Value));
+					if (vals == NULL)
+						return fail(table, cur, "out of memory", NULL, 0);
+
+					// 提取列表值
+					ent.arr.vals = vals;
+					ent.arr.n = 0;
+					for (b = v; b <= ve; b = p + 1) {
+						p = (const char*)memchr(b, ',', ve - b);
+						if (p == NULL)
+							p = ve;
+
+						t = trim(b, p, &len);
+						if (len > 0) {
+							if (!typed(&vals[ent.arr.n], t, len, quoted(b, t)))
+								return fail(table, cur, "bad value", t, len);
+
+							ent.arr.n++;
+						}
+					}
+
+					if (ent.arr.n == 0)
+						return true;
+
+				} else {
+					Value* val = (Value*)table->alloc(sizeof(Value));
+					if (val == NULL)
+						return fail(table, cur, "out of memory", NULL, 0);
+
+					if (!typed(val, v, len, quoted(p + 1, v)))
+						return fail(table, cur, "bad value", v, len);
+
+					ent.arr.vals = val;
+					ent.arr.n = 1;
+				}
+
+				if (!spans(table, ent.arr))
+					return fail(table, cur, "out of memory", NULL, 0);
+
+				try {
+					table->entbuf.push_back(ent);
+				} catch (std::bad_alloc& e) {
+					return fail(table, cur, "out of memory", NULL, 0);
+				}
+			}
+
+			return true;
+		}
+
+		// include "pattern": 没有'='、以include和空白开始的行, 返回去掉引号的模式
+		static bool directive(const char* b, const char* e, const char** pat, size_t* len) {
+			if (e - b < 8 || memcmp(b, "include", 7) != 0 || !isspace(b[7]) || memchr(b, '=', e - b) != NULL)
+				return false;
+
+			*pat = trim(b + 8, e, len);
+			return true;
+		}
+
+		static bool include(Table* t, const Cursor& cur, const char* pat, size_t len) {
+			if (len == 0)
+				return fail(t, cur, "empty include", NULL, 0);
+
+			try {
+				Include inc = {std::string(pat, len), cur.line};
+				t->incs.push_back(inc);
+			} catch (std::bad_alloc& e) {
+				return fail(t, cur, "out of memory", NULL, 0);
+			}
+
+			return true;
+		}
+
+		static bool fail(Table* t, const Cursor& cur, const char* what, const char* s, size_t n) {
+			char b[128];
+
+			if (s == NULL)
+				snprintf(b, sizeof(b), "line %lu: %s", (unsigned long)cur.line, what);
+			else
+				snprintf(b, sizeof(b), "line %lu: %s '%.*s'", (unsigned long)cur.line, what,
+						(int)(n < 64 ? n : 64), s);
+
+			t->err = b;
+			return false;
+		}
+
+		// 解析值的类型, 只有带能识别的单位而数值超出范围时返回false
+		// 无法识别的后缀和超出范围的数字都是字符串
+		static bool typed(Value* v, const char* s, size_t n, bool quoted) {
+			v->s = s;
+			v->n = (uint32_t)n;
+			v->t = Value::Tstring;
+			v->i = 0;
+			v->f = 0;
+			v->b = !equal(s, n, "0") && !equal(s, n, "false") && !equal(s, n, "False") && !equal(s, n, "FALSE");
+
+			if (quoted)
+				return true;
+
+			if (equal(s, n, "true") || equal(s, n, "True") || equal(s, n, "TRUE")
+					|| equal(s, n, "false") || equal(s, n, "False") || equal(s, n, "FALSE")) {
+				v->t = Value::Tbool;
+				v->i = v->b ? 1 : 0;
+				v->f = v->i;
+				return true;
+			}
+
+			// 以数字开头的才可能是数值
+			const char* d = s;
+			if (d < s + n && (*d == '+' || *d == '-'))
+				d++;
+			if (d < s + n && *d == '.')
+				d++;
+			if (d >= s + n || !isdigit(*d) || n >= 64)
+				return true;
+
+			char b[64];
+			memcpy(b, s, n);
+			b[n] = '\0';
+
+			char* q = NULL;
+			const char* x = b + (d - s);
+			bool hex = x[0] == '0' && (x[1] == 'x' || x[1] == 'X');
+			bool integral = hex || strpbrk(b, ".eE") == NULL;
+
+			errno = 0;
+			if (integral) {
+				long long i = strtoll(b, &q, hex ? 16 : 10);
+				v->i = i;
+				v->f = (double)i;
+			} else {
+				double f = strtod(b, &q);
+				v->f = f;
+				v->i = (int64_t)f;
+			}
+
+			if (errno == ERANGE) {
+				v->i = 0;
+				v->f = 0;
+				return true;
+			}
+
+			if (*q == '\0') {
+				v->t = integral ? Value::Tint : Value::Tfloat;
+				return true;
+			}
+
+			// 数字后面全是字母时是单位, 其他情况是普通字符串(如IP地址)
+			for (const char* u = q; *u != '\0'; u++) {
+				if (!isalpha(*u)) {
+					v->i = 0;
+					v->f = 0;
+					return true;
+				}
+			}
+
+			// 带单位时数字部分按浮点数解析, 允许1.5s
+			double num = integral ? (double)v->i : v->f;
+			if (!integral || hex)
+				num = strtod(b, NULL);
+
+			static const struct {
+				const char*	name;
+				int		type;
+				double		mult;
+			} units[] = {
+				{"ns", Value::Tduration, 1.0},
+				{"us", Value::Tduration, 1e3},
+				{"ms", Value::Tduration, 1e6},
+				{"s",  Value::Tduration, 1e9},
+				{"m",  Value::Tduration, 60e9},
+				{"h",  Value::Tduration, 3600e9},
+				{"d",  Value::Tduration, 86400e9},
+				{"B",  Value::Tsize, 1.0},
+				{"K",  Value::Tsize, 1024.0},
+				{"KB", Value::Tsize, 1024.0},
+				{"KiB", Value::Tsize, 1024.0},
+				{"M",  Value::Tsize, 1048576.0},
+				{"MB", Value::Tsize, 1048576.0},
+				{"MiB", Value::Tsize, 1048576.0},
+				{"G",  Value::Tsize, 1073741824.0},
+				{"GB", Value::Tsize, 1073741824.0},
+				{"GiB", Value::Tsize, 1073741824.0},
+				{"T",  Value::Tsize, 1099511627776.0},
+				{"TB", Value::Tsize, 1099511627776.0},
+				{"TiB", Value::Tsize, 1099511627776.0},
+			};
+
+			for (size_t k = 0; !hex && k < sizeof(units) / sizeof(units[0]); k++) {
+				if (strcmp(q, units[k].name) == 0) {
+					double r = num * units[k].mult;
+					if (r > 9.2e18 || r < -9.2e18)
+						return false;
+
+					v->t = units[k].type;
+					v->i = (int64_t)(r < 0 ? r - 0.5 : r + 0.5);
+					v->f = (double)v->i;
+					return true;
+				}
+			}
+
+			v->i = 0;
+			v->f = 0;
+			return true;
+		}
+
+		// 列表全是整数或数值时在arena中生成连续数组
+		static bool spans(Table* t, Array& arr) {
+			bool ints = true;
+			bool nums = true;
+
+			for (size_t i = 0; i < arr.n; i++) {
+				int type = arr.vals[i].t;
+				if (type != Value::Tint && type != Value::Tduration && type != Value::Tsize) {
+					ints = false;
+					if (type != Value::Tfloat)
+						nums = false;
+				}
+			}
+
+			arr.is = NULL;
+			arr.fs = NULL;
+
+			if (ints) {
+				int64_t* is = (int64_t*)t->alloc(arr.n * sizeof(int64_t));
+				if (is == NULL)
+					return false;
+
+				for (size_t i = 0; i < arr.n; i++)
+					is[i] = arr.vals[i].i;
+				arr.is = is;
+			}
+
+			if (nums) {
+				double* fs = (double*)t->alloc(arr.n * sizeof(double));
+				if (fs == NULL)
+					return false;
+
+				for (size_t i = 0; i < arr.n; i++)
+					fs[i] = arr.vals[i].f;
+				arr.fs = fs;
+			}
+
+			return true;
+		}
+
+		static bool equal(const char* s, size_t n, const char* t) {
+			return strlen(t) == n && memcmp(s, t, n) == 0;
+		}
+
+		// 去掉引号后的值是否曾被引号包围
+		static bool quoted(const char* lo, const char* t) {
+			return t > lo && (*(t - 1) == '"' || *(t - 1) == '\'');
+		}
+
+		// 去掉首尾的空白字符和引号
+		static const char* trim(const char* b, const char* e, size_t* len) {
+			while (b < e && (isspace(*b) || *b == '"' || *b == '\''))
+				b++;
+
+			while (e > b && (isspace(*(e - 1)) || *(e - 1) == '"' || *(e - 1) == '\''))
+				e--;
+
+			*len = e - b;
+			return b;
+		}
+
+		static const char* rfind(const char* b, const char* e, char c) {
+			while (e > b) {
+				if (*--e == c)
+					return e;
+			}
+
+			return NULL;
+		}
+
+		// 全局键值的节名为NULL, 长度为0时不调用memcmp
+		static int compare(const char* a, size_t an, const char* b, size_t bn) {
+			size_t n = an < bn ? an : bn;
+			int c = n == 0 ? 0 : memcmp(a, b, n);
+			if (c != 0)
+				return c;
+
+			return an < bn ? -1 : (an > bn ? 1 : 0);
+		}
+
+		// 先按节名再按键名比较, 全局键值排在最前
+		static int compare(const Entry& a, const Entry& b) {
+			int c = compare(a.sec, a.seclen, b.sec, b.seclen);
+			if (c != 0)
+				return c;
+
+			return compare(a.key, a.keylen, b.key, b.keylen);
+		}
+
+		static bool less(const Entry& a, const Entry& b) {
+			return compare(a, b) < 0;
+		}
+
+		static bool same(const Entry& a, const Entry& b) {
+			return compare(a, b) == 0;
+		}
+
+		// FNV-1a
+		static uint64_t hash(uint64_t h, const char* s, size_t n) {
+			if (h == 0)
+				h = 14695981039346656037ULL;
+
+			for (size_t i = 0; i < n; i++) {
+				h ^= (unsigned char)s[i];
+				h *= 1099511628211ULL;
+			}
+
+			return h;
+		}
+
+		static bool sameSection(const Entry* a, const Entry* b) {
+			return compare(a->sec, a->seclen, b->sec, b->seclen) == 0;
+		}
+
+	private:
+		Table*		tab;		// 当前快照
+		std::string	file;
+		int		mode;
+		std::string	img;
+
+		pthread_mutex_t	wlock;		// 重新加载、回收和登记通知
+		uint32_t	gens;
+		uint64_t	epoch;
+		std::vector<Retired> retired;
+		std::vector<Hook> hooks;
+		std::string	lasterr;
+
+		pthread_key_t	rkey;		// 本线程上次用过的槽
+		Slot		readers[Rmax];
+		pthread_mutex_t	olock;		// 保护overs
+		Slot		over;		// 读者槽用完时共用的溢出槽
+		int		overs;		// 使用溢出槽的Pin数
+
+		bool		watching;
+		pthread_t	wtid;
+		int		ifd;
+		int		stop[2];
+		std::string	base;
+	};
+
+	template<size_t N>
+	const size_t Conf<N>::Rmax;
 }
 
 #endif
@@ -0,0 +1,207 @@
+//
+// 可在C++20协程中等待的通道, 需要-std=c++20
+// 等待时挂起协程而不是线程, 数据或空间就绪后把协程交给执行器恢复
+//
+// smp::Loop loop(4);				// 4个线程恢复协程
+// smp::Cchan<int> ch(loop, 1024);
+//
+// smp::Spawn producer(smp::Cchan<int>& ch) {
+//	for (int i = 0; i < 100; i++)
+//		if (!co_await ch.send(i))	// 已关闭
+//			break;
+//	ch.close();
+// }
+//
+// smp::Spawn consumer(smp::Cchan<int>& ch) {
+//	while (std::optional<int> v = co_await ch.recv())	// 关闭且读完后为空
+//		use(*v);
+// }
+//
+// Cchan仍是Chan, 线程可以同时用<<和>>阻塞地收发
+//
+
+#ifndef SMP_CORO_H
+#define SMP_CORO_H
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <vector>
+#include <pthread.h>
+
+#include "chan.h"
+
+namespace smp {
+	// 执行器: 把就绪的协程交给某个线程恢复
+	class Executor {
+	public:
+		virtual ~Executor() {
+		}
+
+		virtual void post(std::coroutine_handle<> h) = 0;
+	};
+
+	// 固定数量的线程从无界通道中取出协程恢复
+	// 析构时关闭通道, 等待已提交的协程全部执行后退出
+	class Loop: public Executor {
+	public:
+		Loop(int threads = 1) {
+			for (int i = 0; i < threads; i++) {
+				pthread_t tid;
+				if (pthread_create(&tid, NULL, run, this) == 0)
+					tids.push_back(tid);
+			}
+		}
+
+		~Loop() {
+			q.close();
+			for (size_t i = 0; i < tids.size(); i++)
+				pthread_join(tids[i], NULL);
+		}
+
+		// 没有线程时在调用者中直接恢复
+		virtual void post(std::coroutine_handle<> h) {
+			if (tids.empty() || !(q << h))
+				h.resume();
+		}
+
+	private:
+		Loop(const Loop&);
+		Loop& operator = (const Loop&);
+
+		static void* run(void* arg) {
+			Loop* l = (Loop*)arg;
+			std::coroutine_handle<> h;
+			while (l->q >> h)
+				h.resume();
+
+			return NULL;
+		}
+
+	private:
+		Chan<std::coroutine_handle<> >	q;
+		std::vector<pthread_t>		tids;
+	};
+
+	// 立即开始执行、结束后自行销毁的协程, 异常终止进程
+	struct Spawn {
+		struct promise_type {
+			Spawn get_return_object() {
+				return Spawn();
+			}
+
+			std::suspend_never initial_suspend() noexcept {
+				return std::suspend_never();
+			}
+
+			std::suspend_never final_suspend() noexcept {
+				return std::suspend_never();
+			}
+
+			void return_void() {
+			}
+
+			void unhandled_exception() {
+				std::terminate();
+			}
+		};
+	};
+
+	template<typename T>
+	class Cchan: public Chan<T> {
+	public:
+		typedef typename Chan<T>::Waiter Waiter;
+
+		Cchan(Executor& ex, size_t capacity = 0): Chan<T>(capacity), ex(ex) {
+		}
+
+		// 等待者位于协程帧中, 登记后可能在其他线程被完成, 之后await_suspend不再访问自身
+		class Op: public Waiter {
+		public:
+			Op(Cchan* ch): ch(ch), result(Chan<T>::Rok) {
+				this->data = &item;
+			}
+
+			bool await_ready() {
+				return false;
+			}
+
+			virtual void done(int r) {
+				result = r;
+				ch->ex.post(h);
+			}
+
+		protected:
+			Op(const Op&);
+			Op& operator = (const Op&);
+
+			Cchan*			ch;
+			std::coroutine_handle<>	h;
+			int			result;
+			T			item;
+		};
+
+		class Recv: public Op {
+		public:
+			Recv(Cchan* ch): Op(ch) {
+			}
+
+			bool await_suspend(std::coroutine_handle<> h) {
+				this->h = h;
+				int r = this->ch->Chan<T>::recv(this);
+				if (r == Chan<T>::Rwait)
+					return true;
+
+				this->result = r;
+				return false;
+			}
+
+			std::optional<T> await_resume() {
+				if (this->result != Chan<T>::Rok)
+					return std::nullopt;
+
+				return std::optional<T>(std::move(this->item));
+			}
+		};
+
+		class Send: public Op {
+		public:
+			Send(Cchan* ch, const T& v): Op(ch) {
+				this->item = v;
+			}
+
+			bool await_suspend(std::coroutine_handle<> h) {
+				this->h = h;
+				int r = this->ch->Chan<T>::send(this);
+				if (r == Chan<T>::Rwait)
+					return true;
+
+				this->result = r;
+				return false;
+			}
+
+			bool await_resume() {
+				return this->result == Chan<T>::Rok;
+			}
+		};
+
+		// co_await ch.recv(): 关闭且读完后返回空
+		Recv recv() {
+			return Recv(this);
+		}
+
+		// co_await ch.send(v): 已关闭返回false
+		Send send(const T& v) {
+			return Send(this, v);
+		}
+
+	private:
+		Cchan(const Cchan&);
+		Cchan& operator = (const Cchan&);
+
+	private:
+		Executor&	ex;
+	};
+}
+
+#endif
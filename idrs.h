@@ -10,6 +10,8 @@
 #include <pthread.h>
 #include <sched.h>
 
+#include "stat.h"
+
 namespace smp {
 	template <size_t N>
 	class Idrs {
@@ -29,8 +31,11 @@ namespace smp {
 		size_t get() {
 			size_t id;
 			size_t last = next;
-			pthread_spin_lock(&lock);
+			size_t probes = 0;
+			acquire();
 			while (true) {
+				probes++;
+
 				// 已被占用且在有效期内
 				if (ids[next].used && now() <= ids[next].timo) {
 					if (++next >= N)
@@ -44,6 +49,8 @@ namespace smp {
 				}
 
 				id = next;
+				if (!ids[id].used)
+					SMP_STAT_ADD(Cidrsused, 1);
 				ids[id].used = true;
 				ids[id].timo = now() + span;
 
@@ -52,18 +59,24 @@ namespace smp {
 
 				break;
 			}
-			pthread_spin_unlock(&lock);
+			release();
 
+			SMP_STAT_ADD(Cidrsget, 1);
+			SMP_STAT_ADD(Cidrsprobe, probes);
+			SMP_STAT_REC(Hidrsprobe, probes);
 			return id;
 		}
 
 		void put(size_t id) {
-			pthread_spin_lock(&lock);
+			acquire();
 			if (id < N) {
+				if (ids[id].used)
+					SMP_STAT_ADD(Cidrsused, -1);
 				ids[id].used = false;
 				ids[id].timo = 0;
 			}
-			pthread_spin_unlock(&lock);
+			release();
+			SMP_STAT_ADD(Cidrsput, 1);
 		}
 
 	private:
@@ -74,6 +87,25 @@ namespace smp {
 			return time(NULL);
 		}
 
+		// 定义SMP_STAT时记录自旋锁的等待和持有时间
+#ifdef SMP_STAT
+		void acquire() {
+			held = Stat::lock(&lock, Stat::Hidrslockwait);
+		}
+
+		void release() {
+			Stat::unlock(&lock, Stat::Hidrslockhold, held);
+		}
+#else
+		void acquire() {
+			pthread_spin_lock(&lock);
+		}
+
+		void release() {
+			pthread_spin_unlock(&lock);
+		}
+#endif
+
 	private:
 		struct ID {
 			bool	used;
@@ -86,6 +118,9 @@ namespace smp {
 		pthread_spinlock_t lock;
 		ID ids[N];
 		size_t next;
+#ifdef SMP_STAT
+		uint64_t held;		// 取得锁的时刻
+#endif
 	};
 }
 
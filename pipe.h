@@ -0,0 +1,413 @@
+//
+// 多阶段流水线: 每个阶段若干线程, 阶段之间用有界的Chan成批传递
+//
+// bool parse(Msg& m);				// 返回false丢弃该元素
+// bool encode(Msg& m);
+//
+// smp::Pipe<Msg> pipe(64);			// 每批最多64个元素
+// pipe.stage("parse", parse, 2, 4096, pipe.cpus(0, 2))	// 2个线程分别绑定到CPU 0和1, 入口队列容量4096个元素
+//     .stage("encode", encode);
+// pipe.start();
+// pipe.push(m);				// 入口队列满时阻塞, start之前返回false
+// pipe.stop();					// 按阶段顺序处理完所有元素后退出
+//
+// 所有阶段处理同一类型的元素, 需要转换时使用包含各阶段数据的结构或指针
+// 每个阶段只有一个线程时保持元素顺序
+//
+
+#ifndef SMP_PIPE_H
+#define SMP_PIPE_H
+
+#include <ctime>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "chan.h"
+#include "pool.h"
+
+namespace smp {
+	template<typename T>
+	class Pipe {
+	public:
+		// 阶段的处理, 被该阶段的所有线程同时调用
+		class Stage {
+		public:
+			virtual ~Stage() {
+			}
+
+			// 返回false时元素不再交给下一阶段
+			virtual bool process(T& item) = 0;
+		};
+
+		struct Stats {
+			std::string	name;
+			int		threads;
+			unsigned long	in;		// 处理的元素数
+			unsigned long	out;		// 交给下一阶段(或最后阶段处理成功)的元素数
+			unsigned long	batches;
+			double		rate;		// 每秒处理的元素数, 从start开始计算
+			double		busy;		// 线程处于处理中的时间比例
+			size_t		queued;		// 入口队列当前的批数
+			size_t		capacity;	// 入口队列的容量(批)
+			double		occupancy;	// 每次取出时入口队列占用比例的平均值
+			size_t		peak;		// 入口队列的最大批数
+		};
+
+		// batch: 阶段之间每批最多传递的元素数
+		Pipe(size_t batch = 64): batch(batch > 0 ? batch : 1), ib(NULL), started(false), stopped(false), inflight(0) {
+			pthread_mutex_init(&ilock, NULL);
+			pthread_cond_init(&idle, NULL);
+		}
+
+		~Pipe() {
+			stop();
+
+			for (size_t i = 0; i < nodes.size(); i++) {
+				Batch* b;
+				while (nodes[i]->q->len() > 0 && (*nodes[i]->q >> b))
+					pool.put(b);
+
+				if (nodes[i]->owned)
+					delete nodes[i]->fn;
+				delete nodes[i]->q;
+				delete nodes[i];
+			}
+
+			if (ib != NULL)
+				pool.put(ib);
+			pthread_cond_destroy(&idle);
+			pthread_mutex_destroy(&ilock);
+		}
+
+		// 添加阶段, 在start之前调用
+		// threads: 线程数, capacity: 入口队列容纳的元素数, cpus: 线程依次绑定的CPU, 为空时不绑定
+		Pipe& stage(const char* name, Stage* s, int threads = 1, size_t capacity = 1024,
+				const std::vector<int>& cpus = std::vector<int>()) {
+			return add(name, s, false, threads, capacity, cpus);
+		}
+
+		Pipe& stage(const char* name, bool (*fn)(T&), int threads = 1, size_t capacity = 1024,
+				const std::vector<int>& cpus = std::vector<int>()) {
+			return add(name, new Func(fn), true, threads, capacity, cpus);
+		}
+
+		// 启动所有阶段的线程, 部分线程创建失败时返回false, 已创建的线程照常工作
+		bool start() {
+			if (started || nodes.empty())
+				return false;
+
+			pthread_mutex_lock(&ilock);
+			started = true;
+			pthread_mutex_unlock(&ilock);
+			clock_gettime(CLOCK_MONOTONIC, &begin);
+
+			bool ok = true;
+			for (size_t i = 0; i < nodes.size(); i++) {
+				Node* n = nodes[i];
+				n->live = n->threads;
+
+				for (int k = 0; k < n->threads; k++) {
+					Worker* w = new Worker();
+					w->pipe = this;
+					w->node = i;
+					w->cpu = n->cpus.empty() ? -1 : n->cpus[k % n->cpus.size()];
+
+					pthread_t tid;
+					if (pthread_create(&tid, NULL, run, w) != 0) {
+						delete w;
+						ok = false;
+
+						// 最后一个线程退出时关闭下一阶段, 少启动的线程也要计入
+						if (__atomic_sub_fetch(&n->live, 1, __ATOMIC_ACQ_REL) == 0 && i + 1 < nodes.size())
+							nodes[i + 1]->q->close();
+						continue;
+					}
+
+					n->tids.push_back(tid);
+				}
+			}
+
+			return ok;
+		}
+
+		// 送入第一个阶段, 凑满一批或第一阶段空闲时发送, 入口队列满时阻塞
+		// 未启动或已停止返回false
+		bool push(const T& item) {
+			pthread_mutex_lock(&ilock);
+			if (!started || stopped) {
+				pthread_mutex_unlock(&ilock);
+				return false;
+			}
+
+			if (ib == NULL)
+				ib = pool.get();
+			if (ib == NULL) {
+				pthread_mutex_unlock(&ilock);
+				return false;
+			}
+
+			// 与阶段之间的规则相同, 第一阶段没有积压时立即发出, 低负载时不增加延迟
+			ib->push_back(item);
+			Batch* b = NULL;
+			if (ib->size() >= batch || nodes[0]->q->len() == 0) {
+				b = ib;
+				ib = NULL;
+				inflight++;
+			}
+			pthread_mutex_unlock(&ilock);
+
+			return b == NULL || enter(b);
+		}
+
+		// 发送未凑满的一批
+		bool flush() {
+			pthread_mutex_lock(&ilock);
+			Batch* b = ib;
+			ib = NULL;
+			if (b != NULL)
+				inflight++;
+			pthread_mutex_unlock(&ilock);
+
+			return b == NULL || enter(b);
+		}
+
+		// 停止接收新元素, 各阶段依次处理完队列中的元素后退出
+		void stop() {
+			pthread_mutex_lock(&ilock);
+			bool once = started && !stopped;
+			stopped = true;
+			Batch* b = ib;
+			ib = NULL;
+
+			// 等已取出批的push和flush发送完, 之后才能关闭入口
+			while (once && inflight > 0)
+				pthread_cond_wait(&idle, &ilock);
+			pthread_mutex_unlock(&ilock);
+
+			if (!once) {
+				if (b != NULL)
+					pool.put(b);
+				return;
+			}
+
+			if (b != NULL)
+				send(0, b);
+
+			nodes[0]->q->close();
+			for (size_t i = 0; i < nodes.size(); i++)
+				for (size_t k = 0; k < nodes[i]->tids.size(); k++)
+					pthread_join(nodes[i]->tids[k], NULL);
+		}
+
+		void stats(std::vector<Stats>& out) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			double secs = started ? (now.tv_sec - begin.tv_sec) + (now.tv_nsec - begin.tv_nsec) / 1e9 : 0;
+
+			out.clear();
+			for (size_t i = 0; i < nodes.size(); i++) {
+				Node* n = nodes[i];
+				Stats s;
+
+				s.name = n->name;
+				s.threads = n->threads;
+				s.in = __atomic_load_n(&n->in, __ATOMIC_RELAXED);
+				s.out = __atomic_load_n(&n->out, __ATOMIC_RELAXED);
+				s.batches = __atomic_load_n(&n->batches, __ATOMIC_RELAXED);
+				s.rate = secs > 0 ? s.in / secs : 0;
+				s.busy = secs > 0 ? __atomic_load_n(&n->busy, __ATOMIC_RELAXED) / 1e9 / secs / n->threads : 0;
+				s.queued = n->q->len();
+				s.capacity = n->q->cap();
+				s.occupancy = s.batches > 0 && s.capacity > 0 ?
+						(double)__atomic_load_n(&n->depth, __ATOMIC_RELAXED) / s.batches / s.capacity : 0;
+				s.peak = __atomic_load_n(&n->peak, __ATOMIC_RELAXED);
+				out.push_back(s);
+			}
+		}
+
+		// 从first开始的n个CPU, 用于stage的cpus参数
+		static std::vector<int> cpus(int first, int n = 1) {
+			std::vector<int> v;
+			for (int i = 0; i < n; i++)
+				v.push_back(first + i);
+
+			return v;
+		}
+
+	private:
+		Pipe(const Pipe&);
+		Pipe& operator = (const Pipe&);
+
+		typedef std::vector<T> Batch;
+
+		class Func: public Stage {
+		public:
+			Func(bool (*fn)(T&)): fn(fn) {
+			}
+
+			virtual bool process(T& item) {
+				return fn(item);
+			}
+
+		private:
+			bool (*fn)(T&);
+		};
+
+		struct Node {
+			std::string		name;
+			Stage*			fn;
+			bool			owned;
+			int			threads;
+			std::vector<int>	cpus;
+			Chan<Batch*>*		q;		// 入口队列
+			std::vector<pthread_t>	tids;
+			int			live;		// 未退出的线程数
+
+			unsigned long		in;
+			unsigned long		out;
+			unsigned long		batches;
+			uint64_t		busy;		// 纳秒
+			uint64_t		depth;		// 每次取出时队列批数的累计
+			size_t			peak;
+		};
+
+		struct Worker {
+			Pipe*	pipe;
+			size_t	node;
+			int	cpu;
+		};
+
+		Pipe& add(const char* name, Stage* s, bool owned, int threads, size_t capacity, const std::vector<int>& cpus) {
+			if (started) {
+				if (owned)
+					delete s;
+				return *this;
+			}
+
+			size_t slots = capacity / batch;
+			Node* n = new Node();
+			n->name = name;
+			n->fn = s;
+			n->owned = owned;
+			n->threads = threads > 0 ? threads : 1;
+			n->cpus = cpus;
+			n->q = new Chan<Batch*>(slots > 0 ? slots : 1);
+			n->live = 0;
+			n->in = n->out = n->batches = 0;
+			n->busy = n->depth = 0;
+			n->peak = 0;
+			nodes.push_back(n);
+
+			return *this;
+		}
+
+		// 在ilock之外把一批送入第一阶段, 结束后通知等待的stop
+		bool enter(Batch* b) {
+			bool ok = send(0, b);
+
+			pthread_mutex_lock(&ilock);
+			if (--inflight == 0 && stopped)
+				pthread_cond_broadcast(&idle);
+			pthread_mutex_unlock(&ilock);
+
+			return ok;
+		}
+
+		bool send(size_t i, Batch* b) {
+			if (*nodes[i]->q << b)
+				return true;
+
+			b->clear();
+			pool.put(b);
+			return false;
+		}
+
+		static uint64_t now() {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+
+		static void* run(void* arg) {
+			Worker* w = (Worker*)arg;
+			Pipe* p = w->pipe;
+			size_t i = w->node;
+			Node* n = p->nodes[i];
+			Node* next = i + 1 < p->nodes.size() ? p->nodes[i + 1] : NULL;
+
+			if (w->cpu >= 0) {
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(w->cpu, &set);
+				pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			}
+			delete w;
+
+			Batch* b;
+			Batch* out = NULL;
+			while (*n->q >> b) {
+				size_t depth = n->q->len();
+				if (depth > __atomic_load_n(&n->peak, __ATOMIC_RELAXED))
+					__atomic_store_n(&n->peak, depth, __ATOMIC_RELAXED);
+
+				unsigned long passed = 0;
+				uint64_t t = now();
+				for (size_t k = 0; k < b->size(); k++) {
+					if (!n->fn->process((*b)[k]))
+						continue;
+
+					passed++;
+					if (next == NULL)
+						continue;
+
+					if (out == NULL)
+						out = p->pool.get();
+					if (out != NULL)
+						out->push_back((*b)[k]);
+				}
+
+				__atomic_add_fetch(&n->busy, now() - t, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&n->in, b->size(), __ATOMIC_RELAXED);
+				__atomic_add_fetch(&n->out, passed, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&n->batches, 1, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&n->depth, depth, __ATOMIC_RELAXED);
+
+				b->clear();
+				p->pool.put(b);
+
+				// 凑满一批, 或上游暂时没有更多数据时立即发出, 低负载时不增加延迟
+				if (out != NULL && (out->size() >= p->batch || depth == 0)) {
+					p->send(i + 1, out);
+					out = NULL;
+				}
+			}
+
+			if (out != NULL)
+				p->send(i + 1, out);
+
+			// 本阶段全部退出后关闭下一阶段的入口, 使其处理完剩余的元素后退出
+			if (__atomic_sub_fetch(&n->live, 1, __ATOMIC_ACQ_REL) == 0 && next != NULL)
+				next->q->close();
+
+			return NULL;
+		}
+
+	private:
+		const size_t		batch;
+		std::vector<Node*>	nodes;
+		Pool<Batch>		pool;		// 复用批的存储
+
+		pthread_mutex_t		ilock;		// 保护ib、stopped和inflight
+		pthread_cond_t		idle;		// inflight降为0
+		Batch*			ib;		// 入口正在凑的一批
+		bool			started;
+		bool			stopped;
+		int			inflight;	// 已取出批、正在发送的push和flush
+		struct timespec		begin;
+	};
+}
+
+#endif
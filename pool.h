@@ -9,6 +9,8 @@
 #include <stack>
 #include <pthread.h>
 
+#include "stat.h"
+
 namespace smp {
 	template<typename T>
 	class Pool {
@@ -43,15 +45,17 @@ namespace smp {
 		T* get() {
 			T* item = NULL;
 
-			pthread_mutex_lock(&slock);
+			acquire();
 			if (!s->empty()) {
 				item = s->top();
 				s->pop();
-				pthread_mutex_unlock(&slock);
+				release();
+				SMP_STAT_ADD(Cpoolhit, 1);
 				return item;
 			}
-			pthread_mutex_unlock(&slock);
+			release();
 
+			SMP_STAT_ADD(Cpoolmiss, 1);
 			try {
 				item = new T();
 			} catch (const std::bad_alloc& e) {
@@ -61,20 +65,22 @@ namespace smp {
 			pthread_mutex_lock(&clock);
 			c++;
 			pthread_mutex_unlock(&clock);
+			SMP_STAT_ADD(Cpoolcap, 1);
 
 			return item;
 		}
 
 		// 放入
 		void put(T* item) {
-			pthread_mutex_lock(&slock);
+			acquire();
 			s->push(item);
-			pthread_mutex_unlock(&slock);
+			release();
+			SMP_STAT_ADD(Cpoolput, 1);
 		}
 
 		// 释放元素占用的内存
 		void clean() {
-			pthread_mutex_lock(&slock);
+			acquire();
 			while (!s->empty()) {
 				delete s->top();
 				s->pop();
@@ -82,9 +88,32 @@ namespace smp {
 				pthread_mutex_lock(&clock);
 				c--;
 				pthread_mutex_unlock(&clock);
+				SMP_STAT_ADD(Cpoolcap, -1);
 			}
+			release();
+		}
+
+	private:
+		// 定义SMP_STAT时记录slock的等待和持有时间
+#ifdef SMP_STAT
+		void acquire() {
+			held = Stat::lock(&slock, Stat::Hpoollockwait);
+		}
+
+		void release() {
+			Stat::unlock(&slock, Stat::Hpoollockhold, held);
+		}
+
+		uint64_t	held;		// 取得slock的时刻
+#else
+		void acquire() {
+			pthread_mutex_lock(&slock);
+		}
+
+		void release() {
 			pthread_mutex_unlock(&slock);
 		}
+#endif
 
 	private:
 		std::stack<T*>*	s;
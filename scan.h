@@ -0,0 +1,463 @@
+//
+// 向量化的字节扫描函数: 查找字节集合, 按行切分, 去除空白, 忽略大小写比较
+// x86_64上运行时选择AVX2/SSE2实现, 其他平台使用标量实现
+//
+
+#ifndef SMP_SCAN_H
+#define SMP_SCAN_H
+
+#include <cstring>
+#include <cstddef>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SMP_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#include "buff.h"
+
+namespace smp {
+	class Scan {
+	public:
+		static const int Iscalar = 0;
+		static const int Isse2	 = 1;
+		static const int Iavx2	 = 2;
+
+		// 当前使用的指令集
+		static int isa() {
+			return impl()->isa;
+		}
+
+		// 强制使用指定的指令集(不超过CPU支持的), 用于测试和性能对比
+		// 非线程安全, 应在启动时调用
+		static int use(int level) {
+			Impl** p = current();
+			int best = detect();
+
+			if (level > best)
+				level = best;
+
+			*p = table(level);
+			return level;
+		}
+
+		// 在[p, p + n)中查找第一个属于set[0, k)的字节, 返回其下标, 没有找到返回n
+		static size_t findAny(const char* p, size_t n, const char* set, size_t k) {
+			return impl()->findAny(p, n, set, k);
+		}
+
+		static size_t findAny(const char* p, size_t n, const char* set) {
+			return impl()->findAny(p, n, set, strlen(set));
+		}
+
+		// 记录每个'\n'的下标到offs, 最多max个, 返回记录的个数
+		// 返回max时可能还有剩余, 从offs[max - 1] + 1处继续
+		static size_t lines(const char* p, size_t n, size_t* offs, size_t max) {
+			return impl()->lines(p, n, offs, max);
+		}
+
+		// 去掉首尾的空白字符(' ', '\t', '\n', '\v', '\f', '\r'), 返回起始位置, 长度写入len
+		static const char* trim(const char* p, size_t n, size_t* len) {
+			size_t b = impl()->skip(p, n);
+			size_t e = impl()->rskip(p + b, n - b);
+
+			*len = e;
+			return p + b;
+		}
+
+		// 按ASCII忽略大小写比较n字节是否相同
+		static bool equalNoCase(const char* a, const char* b, size_t n) {
+			return impl()->equalNoCase(a, b, n);
+		}
+
+		// 是否全部是ASCII字符
+		static bool isAscii(const char* p, size_t n) {
+			return impl()->isAscii(p, n);
+		}
+
+		// Buff的前n字节
+		template<size_t N>
+		static size_t findAny(Buff<char, N>& b, size_t n, const char* set) {
+			return findAny(b.data(), n < N ? n : N, set);
+		}
+
+		template<size_t N>
+		static size_t lines(Buff<char, N>& b, size_t n, size_t* offs, size_t max) {
+			return lines(b.data(), n < N ? n : N, offs, max);
+		}
+
+		template<size_t N>
+		static const char* trim(Buff<char, N>& b, size_t n, size_t* len) {
+			return trim(b.data(), n < N ? n : N, len);
+		}
+
+		template<size_t N>
+		static bool isAscii(Buff<char, N>& b, size_t n) {
+			return isAscii(b.data(), n < N ? n : N);
+		}
+
+	private:
+		struct Impl {
+			int isa;
+			size_t (*findAny)(const char*, size_t, const char*, size_t);
+			size_t (*lines)(const char*, size_t, size_t*, size_t);
+			size_t (*skip)(const char*, size_t);
+			size_t (*rskip)(const char*, size_t);
+			bool (*equalNoCase)(const char*, const char*, size_t);
+			bool (*isAscii)(const char*, size_t);
+		};
+
+		static Impl* impl() {
+			return *current();
+		}
+
+		static Impl** current() {
+			static Impl* p = table(detect());
+			return &p;
+		}
+
+		static int detect() {
+#ifdef SMP_SCAN_X86
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2"))
+				return Iavx2;
+			if (__builtin_cpu_supports("sse2"))
+				return Isse2;
+#endif
+			return Iscalar;
+		}
+
+		static Impl* table(int level) {
+			static Impl scalar = {Iscalar, findAnyScalar, linesScalar, skipScalar, rskipScalar,
+						equalNoCaseScalar, isAsciiScalar};
+#ifdef SMP_SCAN_X86
+			static Impl sse2 = {Isse2, findAnySse2, linesSse2, skipSse2, rskipSse2,
+						equalNoCaseSse2, isAsciiSse2};
+			static Impl avx2 = {Iavx2, findAnyAvx2, linesAvx2, skipAvx2, rskipAvx2,
+						equalNoCaseAvx2, isAsciiAvx2};
+
+			if (level == Iavx2)
+				return &avx2;
+			if (level == Isse2)
+				return &sse2;
+#endif
+			return &scalar;
+		}
+
+	private:
+		// 标量实现, 同时处理向量实现剩下的尾部
+
+		static bool isSpace(unsigned char c) {
+			return c == ' ' || (c >= '\t' && c <= '\r');
+		}
+
+		static unsigned char lower(unsigned char c) {
+			return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+		}
+
+		static size_t findAnyScalar(const char* p, size_t n, const char* set, size_t k) {
+			if (k == 0)
+				return n;
+
+			if (k == 1) {
+				const char* q = (const char*)memchr(p, set[0], n);
+				return q == NULL ? n : q - p;
+			}
+
+			bool tab[256] = {false};
+			for (size_t i = 0; i < k; i++)
+				tab[(unsigned char)set[i]] = true;
+
+			for (size_t i = 0; i < n; i++) {
+				if (tab[(unsigned char)p[i]])
+					return i;
+			}
+
+			return n;
+		}
+
+		static size_t linesScalar(const char* p, size_t n, size_t* offs, size_t max) {
+			size_t c = 0;
+			const char* b = p;
+			const char* e = p + n;
+
+			while (c < max && b < e) {
+				const char* q = (const char*)memchr(b, '\n', e - b);
+				if (q == NULL)
+					break;
+
+				offs[c++] = q - p;
+				b = q + 1;
+			}
+
+			return c;
+		}
+
+		static size_t skipScalar(const char* p, size_t n) {
+			size_t i = 0;
+			while (i < n && isSpace(p[i]))
+				i++;
+
+			return i;
+		}
+
+		// 去掉尾部空白后的长度
+		static size_t rskipScalar(const char* p, size_t n) {
+			while (n > 0 && isSpace(p[n - 1]))
+				n--;
+
+			return n;
+		}
+
+		static bool equalNoCaseScalar(const char* a, const char* b, size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				if (lower(a[i]) != lower(b[i]))
+					return false;
+			}
+
+			return true;
+		}
+
+		static bool isAsciiScalar(const char* p, size_t n) {
+			unsigned char m = 0;
+			for (size_t i = 0; i < n; i++)
+				m |= (unsigned char)p[i];
+
+			return (m & 0x80) == 0;
+		}
+
+#ifdef SMP_SCAN_X86
+	private:
+		// SSE2实现, 每次处理16字节
+
+		// 空白字符: ' '或'\t'..'\r'
+		static __m128i spaceSse2(__m128i v) {
+			__m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+			__m128i r = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8('\r' - '\t')), t);
+			return _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+		}
+
+		static __m128i lowerSse2(__m128i v) {
+			__m128i t = _mm_sub_epi8(v, _mm_set1_epi8('A'));
+			__m128i u = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8('Z' - 'A')), t);
+			return _mm_or_si128(v, _mm_and_si128(u, _mm_set1_epi8(0x20)));
+		}
+
+		static size_t findAnySse2(const char* p, size_t n, const char* set, size_t k) {
+			if (k == 0 || k > 16)
+				return findAnyScalar(p, n, set, k);
+
+			__m128i s[16];
+			for (size_t j = 0; j < k; j++)
+				s[j] = _mm_set1_epi8(set[j]);
+
+			size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+				__m128i m = _mm_cmpeq_epi8(v, s[0]);
+				for (size_t j = 1; j < k; j++)
+					m = _mm_or_si128(m, _mm_cmpeq_epi8(v, s[j]));
+
+				unsigned mask = _mm_movemask_epi8(m);
+				if (mask != 0)
+					return i + __builtin_ctz(mask);
+			}
+
+			return i + findAnyScalar(p + i, n - i, set, k);
+		}
+
+		static size_t linesSse2(const char* p, size_t n, size_t* offs, size_t max) {
+			size_t c = 0;
+			size_t i = 0;
+			__m128i nl = _mm_set1_epi8('\n');
+
+			for (; i + 16 <= n; i += 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+				unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+				while (mask != 0) {
+					if (c == max)
+						return c;
+
+					offs[c++] = i + __builtin_ctz(mask);
+					mask &= mask - 1;
+				}
+			}
+
+			size_t r = linesScalar(p + i, n - i, offs + c, max - c);
+			for (size_t j = c; j < c + r; j++)
+				offs[j] += i;
+
+			return c + r;
+		}
+
+		static size_t skipSse2(const char* p, size_t n) {
+			size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+				unsigned mask = ~_mm_movemask_epi8(spaceSse2(v)) & 0xffff;
+				if (mask != 0)
+					return i + __builtin_ctz(mask);
+			}
+
+			return i + skipScalar(p + i, n - i);
+		}
+
+		static size_t rskipSse2(const char* p, size_t n) {
+			while (n >= 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(p + n - 16));
+				unsigned mask = ~_mm_movemask_epi8(spaceSse2(v)) & 0xffff;
+				if (mask != 0)
+					return n - 16 + (32 - __builtin_clz(mask));
+
+				n -= 16;
+			}
+
+			return rskipScalar(p, n);
+		}
+
+		static bool equalNoCaseSse2(const char* a, const char* b, size_t n) {
+			size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				__m128i x = lowerSse2(_mm_loadu_si128((const __m128i*)(a + i)));
+				__m128i y = lowerSse2(_mm_loadu_si128((const __m128i*)(b + i)));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+					return false;
+			}
+
+			return equalNoCaseScalar(a + i, b + i, n - i);
+		}
+
+		static bool isAsciiSse2(const char* p, size_t n) {
+			size_t i = 0;
+			__m128i m = _mm_setzero_si128();
+			for (; i + 16 <= n; i += 16)
+				m = _mm_or_si128(m, _mm_loadu_si128((const __m128i*)(p + i)));
+
+			return _mm_movemask_epi8(m) == 0 && isAsciiScalar(p + i, n - i);
+		}
+
+	private:
+		// AVX2实现, 每次处理32字节
+
+		__attribute__((target("avx2")))
+		static __m256i spaceAvx2(__m256i v) {
+			__m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+			__m256i r = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t);
+			return _mm256_or_si256(r, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+		}
+
+		__attribute__((target("avx2")))
+		static __m256i lowerAvx2(__m256i v) {
+			__m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('A'));
+			__m256i u = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('Z' - 'A')), t);
+			return _mm256_or_si256(v, _mm256_and_si256(u, _mm256_set1_epi8(0x20)));
+		}
+
+		__attribute__((target("avx2")))
+		static size_t findAnyAvx2(const char* p, size_t n, const char* set, size_t k) {
+			if (k == 0 || k > 16)
+				return findAnyScalar(p, n, set, k);
+
+			__m256i s[16];
+			for (size_t j = 0; j < k; j++)
+				s[j] = _mm256_set1_epi8(set[j]);
+
+			size_t i = 0;
+			for (; i + 32 <= n; i += 32) {
+				__m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+				__m256i m = _mm256_cmpeq_epi8(v, s[0]);
+				for (size_t j = 1; j < k; j++)
+					m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, s[j]));
+
+				unsigned mask = _mm256_movemask_epi8(m);
+				if (mask != 0)
+					return i + __builtin_ctz(mask);
+			}
+
+			return i + findAnySse2(p + i, n - i, set, k);
+		}
+
+		__attribute__((target("avx2")))
+		static size_t linesAvx2(const char* p, size_t n, size_t* offs, size_t max) {
+			size_t c = 0;
+			size_t i = 0;
+			__m256i nl = _mm256_set1_epi8('\n');
+
+			for (; i + 32 <= n; i += 32) {
+				__m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+				unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+				while (mask != 0) {
+					if (c == max)
+						return c;
+
+					offs[c++] = i + __builtin_ctz(mask);
+					mask &= mask - 1;
+				}
+			}
+
+			size_t r = linesSse2(p + i, n - i, offs + c, max - c);
+			for (size_t j = c; j < c + r; j++)
+				offs[j] += i;
+
+			return c + r;
+		}
+
+		__attribute__((target("avx2")))
+		static size_t skipAvx2(const char* p, size_t n) {
+			size_t i = 0;
+			for (; i + 32 <= n; i += 32) {
+				__m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+				unsigned mask = ~(unsigned)_mm256_movemask_epi8(spaceAvx2(v));
+				if (mask != 0)
+					return i + __builtin_ctz(mask);
+			}
+
+			return i + skipSse2(p + i, n - i);
+		}
+
+		__attribute__((target("avx2")))
+		static size_t rskipAvx2(const char* p, size_t n) {
+			while (n >= 32) {
+				__m256i v = _mm256_loadu_si256((const __m256i*)(p + n - 32));
+				unsigned mask = ~(unsigned)_mm256_movemask_epi8(spaceAvx2(v));
+				if (mask != 0)
+					return n - 32 + (32 - __builtin_clz(mask));
+
+				n -= 32;
+			}
+
+			return rskipSse2(p, n);
+		}
+
+		__attribute__((target("avx2")))
+		static bool equalNoCaseAvx2(const char* a, const char* b, size_t n) {
+			size_t i = 0;
+			for (; i + 32 <= n; i += 32) {
+				__m256i x = lowerAvx2(_mm256_loadu_si256((const __m256i*)(a + i)));
+				__m256i y = lowerAvx2(_mm256_loadu_si256((const __m256i*)(b + i)));
+				if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xffffffffu)
+					return false;
+			}
+
+			return equalNoCaseSse2(a + i, b + i, n - i);
+		}
+
+		__attribute__((target("avx2")))
+		static bool isAsciiAvx2(const char* p, size_t n) {
+			size_t i = 0;
+			__m256i m = _mm256_setzero_si256();
+			for (; i + 32 <= n; i += 32)
+				m = _mm256_or_si256(m, _mm256_loadu_si256((const __m256i*)(p + i)));
+
+			return _mm256_movemask_epi8(m) == 0 && isAsciiSse2(p + i, n - i);
+		}
+#endif
+
+	private:
+		Scan();
+		Scan(const Scan&);
+		Scan& operator = (const Scan&);
+	};
+}
+
+#endif
@@ -0,0 +1,476 @@
+//
+// 日志输出目标
+// Sink:  输出接口, 语义同writev, 可被多个线程同时调用
+// Fsink: 预分配并mmap的分段文件, 每条记录只是一次memcpy, 按大小或时间轮转
+//
+// Fsink sink("/var/log/app.log", 64 << 20, 3600, 1000);	// 每段64M或1小时, 每秒同步一次
+// if (!sink.ok()) ...
+// log.setOutput(&sink);
+//
+
+#ifndef SMP_SINK_H
+#define SMP_SINK_H
+
+#include <new>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace smp {
+	class Sink {
+	public:
+		virtual ~Sink() {
+		}
+
+		virtual ssize_t writev(const struct iovec* iov, int cnt) = 0;
+
+		// 输出每换到一个新文件加一, 写入者据此在新文件中补写自描述的内容
+		virtual unsigned long generation() {
+			return 0;
+		}
+	};
+
+	// 分段文件名为 path.YYYYmmdd-HHMMSS.序号, path为指向当前分段的符号链接
+	// 写入者用原子加法在当前分段中预留空间后直接拷贝; 越过段尾的写入者负责切换到后台线程预先
+	// 创建好的下一段, 其他越界的写入者在条件变量上等待切换完成后重试
+	// 下一段还没建好时切换者唤醒后台线程并等待, 写入者自己不做文件操作
+	// 后台线程负责预建下一段、按时间轮转、定期同步, 以及在旧段的写入全部完成后截断到实际长度并关闭
+	// 关闭后的Seg留作下一段复用, 数量有界
+	class Fsink: public Sink {
+	public:
+		// size: 每段的字节数, seconds: 每段最长的时间(0不按时间轮转), syncms: 后台同步的间隔(毫秒, 0不同步)
+		Fsink(const char* path, size_t size = 64 << 20, int seconds = 0, int syncms = 1000):
+				path(path), segsize(size), seconds(seconds), syncms(syncms), seq(0),
+				cur(NULL), next(NULL), gen(0), made(0), stop(false), running(false) {
+			pthread_mutex_init(&lock, NULL);
+			pthread_cond_init(&wake, NULL);
+			pthread_cond_init(&ready, NULL);
+
+			Seg* s = create();
+			if (s == NULL)
+				return;
+
+			link(s);
+			__atomic_store_n(&cur, s, __ATOMIC_SEQ_CST);
+
+			running = pthread_create(&tid, NULL, worker, this) == 0;
+		}
+
+		~Fsink() {
+			if (running) {
+				pthread_mutex_lock(&lock);
+				stop = true;
+				pthread_cond_signal(&wake);
+				pthread_cond_broadcast(&ready);
+				pthread_mutex_unlock(&lock);
+				pthread_join(tid, NULL);
+			}
+
+			Seg* s = __atomic_exchange_n(&cur, (Seg*)NULL, __ATOMIC_SEQ_CST);
+			if (s != NULL) {
+				// 后台线程退出后仍可能有切换
+				if (last != s->name)
+					link(s);
+				s->end = __atomic_load_n(&s->off, __ATOMIC_ACQUIRE);
+				if (s->end > s->size)
+					s->end = s->size;
+				finish(s);
+			}
+
+			// 预建但未使用的分段
+			if (next != NULL) {
+				next->end = 0;
+				finish(next);
+				unlink(next->name.c_str());
+			}
+
+			for (size_t i = 0; i < segs.size(); i++)
+				delete segs[i];
+
+			pthread_mutex_destroy(&lock);
+			pthread_cond_destroy(&wake);
+			pthread_cond_destroy(&ready);
+		}
+
+		bool ok() const {
+			return __atomic_load_n(&cur, __ATOMIC_ACQUIRE) != NULL;
+		}
+
+		virtual unsigned long generation() {
+			return __atomic_load_n(&gen, __ATOMIC_ACQUIRE);
+		}
+
+		// 当前分段的文件名
+		std::string current() {
+			pthread_mutex_lock(&lock);
+			std::string s = last;
+			pthread_mutex_unlock(&lock);
+
+			return s;
+		}
+
+		// 一次写入的内容总是位于同一分段内, 超过分段大小返回-1(EMSGSIZE)
+		virtual ssize_t writev(const struct iovec* iov, int cnt) {
+			size_t total = 0;
+			for (int i = 0; i < cnt; i++)
+				total += iov[i].iov_len;
+
+			if (total == 0)
+				return 0;
+
+			if (total > segsize) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+
+			while (true) {
+				Seg* s = __atomic_load_n(&cur, __ATOMIC_SEQ_CST);
+				if (s == NULL) {
+					errno = EIO;
+					return -1;
+				}
+
+				// 先登记再确认仍是当前分段, 后台线程看到writers为0后才会关闭旧段
+				__atomic_add_fetch(&s->writers, 1, __ATOMIC_SEQ_CST);
+				if (__atomic_load_n(&cur, __ATOMIC_SEQ_CST) != s) {
+					__atomic_sub_fetch(&s->writers, 1, __ATOMIC_RELEASE);
+					continue;
+				}
+
+				size_t off = __atomic_fetch_add(&s->off, total, __ATOMIC_ACQ_REL);
+				if (off + total <= s->size) {
+					char* d = s->base + off;
+					for (int i = 0; i < cnt; i++) {
+						memcpy(d, iov[i].iov_base, iov[i].iov_len);
+						d += iov[i].iov_len;
+					}
+
+					__atomic_sub_fetch(&s->writers, 1, __ATOMIC_RELEASE);
+					return (ssize_t)total;
+				}
+
+				__atomic_sub_fetch(&s->writers, 1, __ATOMIC_RELEASE);
+
+				// 恰好越过段尾的写入者负责切换, 其余等待
+				if (off <= s->size)
+					rotate(s, off, false);
+				else
+					await(s);
+			}
+		}
+
+		ssize_t write(const void* data, size_t n) {
+			struct iovec v;
+			v.iov_base = (void*)data;
+			v.iov_len = n;
+
+			return writev(&v, 1);
+		}
+
+	private:
+		Fsink(const Fsink&);
+		Fsink& operator = (const Fsink&);
+
+		struct Seg {
+			int		fd;
+			char*		base;
+			size_t		size;
+			size_t		off;		// 已预留的位置, 越过size后不再有效
+			size_t		end;		// 切换时确定的实际长度
+			int		writers;	// 正在拷贝的写入者
+			time_t		born;
+			std::string	name;
+		};
+
+		Seg* create() {
+			char stamp[32];
+			time_t now = time(NULL);
+			struct tm st_tm;
+
+			localtime_r(&now, &st_tm);
+			strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &st_tm);
+
+			char num[32];
+			snprintf(num, sizeof(num), ".%lu", __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+
+			Seg* s = obtain();
+			if (s == NULL)
+				return NULL;
+
+			try {
+				s->name = path + "." + stamp + num;
+			} catch (const std::bad_alloc& e) {
+				recycle(s);
+				return NULL;
+			}
+
+			s->fd = ::open(s->name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (s->fd < 0) {
+				recycle(s);
+				return NULL;
+			}
+
+			// 文件系统不支持fallocate时退回到稀疏文件
+			if (fallocate(s->fd, 0, 0, segsize) != 0 && ftruncate(s->fd, segsize) != 0) {
+				::close(s->fd);
+				unlink(s->name.c_str());
+				recycle(s);
+				return NULL;
+			}
+
+			void* p = mmap(NULL, segsize, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+			if (p == MAP_FAILED) {
+				::close(s->fd);
+				unlink(s->name.c_str());
+				recycle(s);
+				return NULL;
+			}
+
+			s->base = (char*)p;
+			s->size = segsize;
+			s->off = 0;
+			s->end = 0;
+			s->born = now;
+
+			return s;
+		}
+
+		// 取一个空闲的Seg, 没有时新建
+		// Seg在析构前不释放: 迟到的写入者可能还会增减旧段的writers, 复用时不重置writers,
+		// 这样的写入者再次确认cur时会发现不是当前分段而重试
+		Seg* obtain() {
+			Seg* s = NULL;
+
+			pthread_mutex_lock(&lock);
+			if (!spare.empty()) {
+				s = spare.back();
+				spare.pop_back();
+			}
+			pthread_mutex_unlock(&lock);
+
+			if (s != NULL)
+				return s;
+
+			bool ok = true;
+			try {
+				s = new Seg();
+				s->writers = 0;
+				s->base = NULL;
+			} catch (const std::bad_alloc& e) {
+				return NULL;
+			}
+
+			pthread_mutex_lock(&lock);
+			try {
+				segs.push_back(s);
+				spare.reserve(segs.size());
+			} catch (const std::bad_alloc& e) {
+				ok = false;
+			}
+			pthread_mutex_unlock(&lock);
+
+			if (!ok) {
+				delete s;
+				return NULL;
+			}
+
+			return s;
+		}
+
+		// spare的容量不小于segs的大小, 放回不会失败
+		void recycle(Seg* s) {
+			pthread_mutex_lock(&lock);
+			spare.push_back(s);
+			pthread_mutex_unlock(&lock);
+		}
+
+		// 由越过段尾的一方调用, end为旧段的实际长度, bg表示在后台线程中调用
+		void rotate(Seg* s, size_t end, bool bg) {
+			s->end = end;
+
+			Seg* n = __atomic_exchange_n(&next, (Seg*)NULL, __ATOMIC_ACQ_REL);
+			if (n == NULL && bg) {
+				n = create();
+			} else if (n == NULL) {
+				// 请后台线程创建, 等它尝试一次
+				pthread_mutex_lock(&lock);
+				unsigned long tried = made;
+				pthread_cond_signal(&wake);
+				while (made == tried && !stop && __atomic_load_n(&next, __ATOMIC_ACQUIRE) == NULL)
+					pthread_cond_wait(&ready, &lock);
+				pthread_mutex_unlock(&lock);
+
+				n = __atomic_exchange_n(&next, (Seg*)NULL, __ATOMIC_ACQ_REL);
+			}
+
+			if (n != NULL)
+				n->born = time(NULL);
+
+			// 创建失败时cur为NULL, 写入返回错误, 直到后台线程创建成功
+			__atomic_store_n(&cur, n, __ATOMIC_SEQ_CST);
+			if (n != NULL)
+				__atomic_add_fetch(&gen, 1, __ATOMIC_RELEASE);
+
+			pthread_mutex_lock(&lock);
+			retired.push_back(s);
+			pthread_cond_signal(&wake);
+			pthread_cond_broadcast(&ready);
+			pthread_mutex_unlock(&lock);
+		}
+
+		// 等待其他写入者切换掉分段s
+		void await(Seg* s) {
+			pthread_mutex_lock(&lock);
+			while (__atomic_load_n(&cur, __ATOMIC_SEQ_CST) == s && !stop)
+				pthread_cond_wait(&ready, &lock);
+			pthread_mutex_unlock(&lock);
+		}
+
+		// 等待旧段的写入完成后截断到实际长度并关闭
+		void finish(Seg* s) {
+			while (__atomic_load_n(&s->writers, __ATOMIC_SEQ_CST) != 0)
+				sched_yield();
+
+			munmap(s->base, s->size);
+			if (ftruncate(s->fd, s->end) == 0)
+				fdatasync(s->fd);
+			::close(s->fd);
+			s->base = NULL;
+		}
+
+		// path指向当前分段
+		void link(Seg* s) {
+			std::string tmp = path + ".tmp";
+			const char* name = strrchr(s->name.c_str(), '/');
+			name = name != NULL ? name + 1 : s->name.c_str();
+
+			unlink(tmp.c_str());
+			if (symlink(name, tmp.c_str()) == 0 && rename(tmp.c_str(), path.c_str()) != 0)
+				unlink(tmp.c_str());
+
+			pthread_mutex_lock(&lock);
+			last = s->name;
+			pthread_mutex_unlock(&lock);
+		}
+
+		static void* worker(void* arg) {
+			Fsink* f = (Fsink*)arg;
+			struct timespec lastsync;
+			clock_gettime(CLOCK_MONOTONIC, &lastsync);
+
+			while (true) {
+				std::vector<Seg*> done;
+
+				pthread_mutex_lock(&f->lock);
+				if (!f->stop && f->retired.empty()) {
+					struct timespec ts;
+					clock_gettime(CLOCK_REALTIME, &ts);
+					ts.tv_nsec += 100000000;
+					if (ts.tv_nsec >= 1000000000) {
+						ts.tv_sec++;
+						ts.tv_nsec -= 1000000000;
+					}
+					pthread_cond_timedwait(&f->wake, &f->lock, &ts);
+				}
+
+				bool stop = f->stop;
+				done.swap(f->retired);
+				pthread_mutex_unlock(&f->lock);
+
+				for (size_t i = 0; i < done.size(); i++) {
+					f->finish(done[i]);
+					f->recycle(done[i]);
+				}
+
+				// 停止前也要把链接移到最后一段
+				Seg* s = __atomic_load_n(&f->cur, __ATOMIC_SEQ_CST);
+				if (!done.empty() && s != NULL)
+					f->link(s);
+
+				if (stop)
+					break;
+
+				// 总是备好下一段, 每次尝试后通知等待的切换者
+				if (__atomic_load_n(&f->next, __ATOMIC_ACQUIRE) == NULL) {
+					Seg* n = f->create();
+					if (n != NULL)
+						__atomic_store_n(&f->next, n, __ATOMIC_RELEASE);
+
+					pthread_mutex_lock(&f->lock);
+					f->made++;
+					pthread_cond_broadcast(&f->ready);
+					pthread_mutex_unlock(&f->lock);
+				}
+
+				// 之前切换失败, 用预建的分段恢复
+				if (s == NULL) {
+					Seg* n = __atomic_exchange_n(&f->next, (Seg*)NULL, __ATOMIC_ACQ_REL);
+					if (n != NULL) {
+						n->born = time(NULL);
+						__atomic_store_n(&f->cur, n, __ATOMIC_SEQ_CST);
+						__atomic_add_fetch(&f->gen, 1, __ATOMIC_RELEASE);
+						f->link(n);
+					}
+					continue;
+				}
+
+				// 按时间轮转: 把预留位置推过段尾, 推过的一方负责切换
+				if (f->seconds > 0 && time(NULL) - s->born >= f->seconds) {
+					size_t off = __atomic_fetch_add(&s->off, s->size + 1, __ATOMIC_ACQ_REL);
+					if (off <= s->size)
+						f->rotate(s, off, true);
+					continue;
+				}
+
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				long ms = (now.tv_sec - lastsync.tv_sec) * 1000 + (now.tv_nsec - lastsync.tv_nsec) / 1000000;
+				if (f->syncms > 0 && ms >= f->syncms) {
+					size_t off = __atomic_load_n(&s->off, __ATOMIC_ACQUIRE);
+					msync(s->base, off < s->size ? off : s->size, MS_ASYNC);
+					fdatasync(s->fd);
+					lastsync = now;
+				}
+			}
+
+			return NULL;
+		}
+
+	private:
+		std::string	path;
+		size_t		segsize;
+		int		seconds;
+		int		syncms;
+		unsigned long	seq;
+
+		Seg*		cur;
+		Seg*		next;
+		unsigned long	gen;		// 已启用的分段数, 在cur更新之后增加
+
+		pthread_mutex_t	lock;		// 保护segs, spare, retired, last, made和stop
+		pthread_cond_t	wake;
+		pthread_cond_t	ready;		// 下一段已尝试创建, 或已切换
+		std::vector<Seg*> segs;		// 所有Seg, 析构时释放
+		std::vector<Seg*> spare;	// 已关闭、可复用的Seg
+		std::vector<Seg*> retired;
+		unsigned long	made;		// 后台线程尝试创建下一段的次数
+		std::string	last;
+		bool		stop;
+
+		bool		running;
+		pthread_t	tid;
+	};
+}
+
+#endif
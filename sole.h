@@ -1,20 +1,32 @@
 //
 // 支持多线程的单例模板
+// Sole:  进程内唯一
+// Tsole: 每个线程一个, 线程退出时销毁
+// Csole: 每个CPU一个分片, 可遍历合并所有分片
 //
 // Created by 崔士杰 on 2019/8/8.
 
 #ifndef SMP_SINGLE_H
 #define SMP_SINGLE_H
 
+#include <new>
+#include <cstdlib>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 namespace smp {
 	template <typename T>
 	class Sole {
 	public:
+		// 创建完成后只有一次acquire读
 		static T* instance() {
+			T* p = __atomic_load_n(&item, __ATOMIC_ACQUIRE);
+			if (p != NULL)
+				return p;
+
 			pthread_once(&once_create, init);
-			return item;
+			return __atomic_load_n(&item, __ATOMIC_ACQUIRE);
 		}
 
 		static void destroy() {
@@ -27,14 +39,13 @@ namespace smp {
 		Sole& operator = (const Sole&);
 
 		static void init() {
-			item = new T();
+			__atomic_store_n(&item, new T(), __ATOMIC_RELEASE);
 		}
 
 		static void free() {
-			if (item != NULL) {
-				delete item;
-				item = NULL;
-			}
+			T* p = __atomic_exchange_n(&item, (T*)NULL, __ATOMIC_ACQ_REL);
+			if (p != NULL)
+				delete p;
 		}
 
 	private:
@@ -51,6 +62,191 @@ namespace smp {
 
 	template <typename T>
 	pthread_once_t Sole<T>::once_delete = PTHREAD_ONCE_INIT;
+
+	// 每个线程一个实例, 线程退出时自动销毁
+	template <typename T>
+	class Tsole {
+	public:
+		static T* instance() {
+			T* p = cache;
+			if (p != NULL)
+				return p;
+
+			return create();
+		}
+
+		// 提前销毁当前线程的实例, 之后再调用instance()会重新创建
+		static void destroy() {
+			T* p = cache;
+			if (p == NULL)
+				return;
+
+			cache = NULL;
+			pthread_setspecific(key, NULL);
+			delete p;
+		}
+
+	private:
+		Tsole();
+		Tsole(const Tsole&);
+		Tsole& operator = (const Tsole&);
+
+		static T* create() {
+			T* p = NULL;
+
+			pthread_once(&once_create, key_create);
+			try {
+				p = new T();
+			} catch (const std::bad_alloc& e) {
+				return NULL;
+			}
+
+			pthread_setspecific(key, p);
+			cache = p;
+			return p;
+		}
+
+		static void key_create() {
+			pthread_key_create(&key, destructor);
+		}
+
+		static void destructor(void* arg) {
+			cache = NULL;
+			delete (T*)arg;
+		}
+
+	private:
+		static __thread T* cache;
+		static pthread_key_t key;
+		static pthread_once_t once_create;
+	};
+
+	template <typename T>
+	__thread T* Tsole<T>::cache = NULL;
+
+	template <typename T>
+	pthread_key_t Tsole<T>::key;
+
+	template <typename T>
+	pthread_once_t Tsole<T>::once_create = PTHREAD_ONCE_INIT;
+
+	// 每个CPU一个分片, 分片按缓存行对齐
+	// 线程取得分片后可能被迁移到其他CPU, 所以同一分片偶尔会被多个线程同时访问,
+	// T内部仍需使用原子操作或轻量的锁, 只是几乎不会发生争用
+	template <typename T>
+	class Csole {
+	public:
+		// 当前CPU的分片
+		static T* instance() {
+			Shard* s = shards();
+			if (s == NULL)
+				return NULL;
+
+			int cpu = sched_getcpu();
+			if (cpu < 0)
+				cpu = 0;
+
+			return &s[(size_t)cpu % n].item;
+		}
+
+		// 分片数
+		static size_t count() {
+			return shards() != NULL ? n : 0;
+		}
+
+		static T* at(size_t i) {
+			Shard* s = shards();
+			if (s == NULL || i >= n)
+				return NULL;
+
+			return &s[i].item;
+		}
+
+		// 依次对每个分片调用f(T*)
+		template <typename F>
+		static void visit(F& f) {
+			Shard* s = shards();
+			for (size_t i = 0; s != NULL && i < n; i++)
+				f(&s[i].item);
+		}
+
+		// 合并所有分片: r = f(r, const T&)
+		template <typename R, typename F>
+		static R fold(R init, F f) {
+			Shard* s = shards();
+			for (size_t i = 0; s != NULL && i < n; i++)
+				init = f(init, (const T&)s[i].item);
+
+			return init;
+		}
+
+		static void destroy() {
+			pthread_once(&once_delete, free);
+		}
+
+	private:
+		Csole();
+		Csole(const Csole&);
+		Csole& operator = (const Csole&);
+
+		struct Shard {
+			T item;
+		} __attribute__((aligned(64)));
+
+		static Shard* shards() {
+			Shard* s = __atomic_load_n(&items, __ATOMIC_ACQUIRE);
+			if (s != NULL)
+				return s;
+
+			pthread_once(&once_create, init);
+			return __atomic_load_n(&items, __ATOMIC_ACQUIRE);
+		}
+
+		static void init() {
+			void* mem = NULL;
+			long cpus = sysconf(_SC_NPROCESSORS_CONF);
+			size_t cnt = cpus > 0 ? (size_t)cpus : 1;
+
+			if (posix_memalign(&mem, 64, cnt * sizeof(Shard)) != 0)
+				return;
+
+			Shard* s = (Shard*)mem;
+			for (size_t i = 0; i < cnt; i++)
+				new (&s[i]) Shard();
+
+			n = cnt;
+			__atomic_store_n(&items, s, __ATOMIC_RELEASE);
+		}
+
+		static void free() {
+			Shard* s = __atomic_exchange_n(&items, (Shard*)NULL, __ATOMIC_ACQ_REL);
+			if (s == NULL)
+				return;
+
+			for (size_t i = 0; i < n; i++)
+				s[i].~Shard();
+
+			::free(s);
+		}
+
+	private:
+		static Shard* items;
+		static size_t n;
+		static pthread_once_t once_create;
+		static pthread_once_t once_delete;
+	};
+
+	template <typename T>
+	typename Csole<T>::Shard* Csole<T>::items = NULL;
+
+	template <typename T>
+	size_t Csole<T>::n = 0;
+
+	template <typename T>
+	pthread_once_t Csole<T>::once_create = PTHREAD_ONCE_INIT;
+
+	template <typename T>
+	pthread_once_t Csole<T>::once_delete = PTHREAD_ONCE_INIT;
 }
 
 #endif
@@ -0,0 +1,369 @@
+//
+// 可选的运行统计: 每线程计数器和对数分桶的直方图, 按需合并为快照导出
+//
+// 编译时定义SMP_STAT(整个程序一致, 如-DSMP_STAT)后, Chan, Pool, Idrs和Ulog记录下列统计,
+// 未定义时这些记录不产生任何代码
+//
+// smp::Stat::Snapshot s;
+// smp::Stat::snapshot(s);
+// s.counter(smp::Stat::Cpoolmiss);
+// s.percentile(smp::Stat::Hchanlockwait, 0.99);
+// fputs(s.json().c_str(), f);
+//
+
+#ifndef SMP_STAT_H
+#define SMP_STAT_H
+
+#include <new>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "sole.h"
+
+namespace smp {
+	class Stat {
+	public:
+		// 计数器, 每个线程记录增量, 合并时求和; 带gauge的是增减相抵后的当前值
+		static const int Cchansend	= 0;
+		static const int Cchanrecv	= 1;
+		static const int Cchandepth	= 2;	// gauge: 所有通道中的元素数
+		static const int Cpoolhit	= 3;
+		static const int Cpoolmiss	= 4;
+		static const int Cpoolput	= 5;
+		static const int Cpoolcap	= 6;	// gauge: 所有池已分配的元素数
+		static const int Cidrsget	= 7;
+		static const int Cidrsput	= 8;
+		static const int Cidrsused	= 9;	// gauge: 被占用的ID数, 超时回收的不计
+		static const int Cidrsprobe	= 10;	// get检查过的位置数
+		static const int Culoglines	= 11;
+		static const int Culogbytes	= 12;
+		static const int Culogdrop	= 13;
+		static const int Cmax		= 14;
+
+		// 直方图, 时间单位为纳秒
+		static const int Hchandepth	= 0;	// 发送时通道中的元素数
+		static const int Hchansend	= 1;	// 发送等待容量的时间
+		static const int Hchanrecv	= 2;	// 接收等待数据的时间
+		static const int Hchanlockwait	= 3;	// qlock
+		static const int Hchanlockhold	= 4;
+		static const int Hpoollockwait	= 5;	// slock
+		static const int Hpoollockhold	= 6;
+		static const int Hidrsprobe	= 7;	// 每次get检查的位置数
+		static const int Hidrslockwait	= 8;	// 自旋锁
+		static const int Hidrslockhold	= 9;
+		static const int Hmax		= 10;
+
+		// 每个2的幂区间分为16格, 相对误差不超过1/16; 超过2^40的值计入最后一格
+		static const int Sub	 = 16;
+		static const int Buckets = (40 - 3) * Sub;
+
+		struct Hist {
+			uint64_t	count;
+			uint64_t	sum;
+			uint64_t	max;
+			uint64_t	b[Buckets];
+		};
+
+		// 合并后的统计
+		class Snapshot {
+		public:
+			Snapshot(): c(Cmax), h(Hmax) {
+				clear();
+			}
+
+			int64_t counter(int i) const {
+				return c[i];
+			}
+
+			uint64_t count(int i) const {
+				return h[i].count;
+			}
+
+			uint64_t max(int i) const {
+				return h[i].max;
+			}
+
+			double mean(int i) const {
+				return h[i].count > 0 ? (double)h[i].sum / h[i].count : 0;
+			}
+
+			// p为0到1之间的分位, 返回所在格的上界, 不超过最大值
+			uint64_t percentile(int i, double p) const {
+				const Hist& x = h[i];
+				if (x.count == 0)
+					return 0;
+
+				uint64_t rank = (uint64_t)(p * x.count + 0.5);
+				if (rank < 1)
+					rank = 1;
+
+				uint64_t seen = 0;
+				for (int k = 0; k < Buckets; k++) {
+					seen += x.b[k];
+					if (seen >= rank) {
+						uint64_t v = upper(k);
+						return v < x.max ? v : x.max;
+					}
+				}
+
+				return x.max;
+			}
+
+			// {"counters": {"chan.send": 10, ...}, "histograms": {"chan.lock_wait_ns": {"count": 10, ...}, ...}}
+			std::string json() const {
+				std::string s = "{\"counters\": {";
+				char b[256];
+
+				for (int i = 0; i < Cmax; i++) {
+					snprintf(b, sizeof(b), "%s\"%s\": %lld", i > 0 ? ", " : "", counterNames()[i], (long long)c[i]);
+					s += b;
+				}
+
+				s += "}, \"histograms\": {";
+				for (int i = 0; i < Hmax; i++) {
+					snprintf(b, sizeof(b), "%s\"%s\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %llu, "
+							"\"p99\": %llu, \"p999\": %llu, \"max\": %llu}", i > 0 ? ", " : "",
+							histNames()[i], (unsigned long long)count(i), mean(i),
+							(unsigned long long)percentile(i, 0.50), (unsigned long long)percentile(i, 0.99),
+							(unsigned long long)percentile(i, 0.999), (unsigned long long)max(i));
+					s += b;
+				}
+
+				s += "}}\n";
+				return s;
+			}
+
+		private:
+			friend class Stat;
+
+			void clear() {
+				for (int i = 0; i < Cmax; i++)
+					c[i] = 0;
+				for (int i = 0; i < Hmax; i++)
+					memset(&h[i], 0, sizeof(Hist));
+			}
+
+			std::vector<int64_t>	c;
+			std::vector<Hist>	h;
+		};
+
+		static const char* const* counterNames() {
+			static const char* const names[Cmax] = {
+				"chan.send", "chan.recv", "chan.depth",
+				"pool.hit", "pool.miss", "pool.put", "pool.cap",
+				"idrs.get", "idrs.put", "idrs.used", "idrs.probe",
+				"ulog.lines", "ulog.bytes", "ulog.dropped",
+			};
+
+			return names;
+		}
+
+		static const char* const* histNames() {
+			static const char* const names[Hmax] = {
+				"chan.depth", "chan.send_wait_ns", "chan.recv_wait_ns", "chan.lock_wait_ns", "chan.lock_hold_ns",
+				"pool.lock_wait_ns", "pool.lock_hold_ns",
+				"idrs.probe", "idrs.lock_wait_ns", "idrs.lock_hold_ns",
+			};
+
+			return names;
+		}
+
+		static uint64_t now() {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+
+		// 只由所属线程修改, 用原子读写避免合并时读到撕裂的值, 不需要加锁的指令
+		static void add(int i, int64_t n) {
+			Local* l = Tsole<Local>::instance();
+			if (l == NULL)
+				return;
+
+			int64_t* p = &l->s.c[i];
+			__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+		}
+
+		static void record(int i, uint64_t v) {
+			Local* l = Tsole<Local>::instance();
+			if (l == NULL)
+				return;
+
+			Hist& x = l->s.h[i];
+			inc(&x.b[bucket(v)], 1);
+			inc(&x.count, 1);
+			inc(&x.sum, v);
+			if (v > x.max)
+				__atomic_store_n(&x.max, v, __ATOMIC_RELAXED);
+		}
+
+		// 合并所有线程(包括已退出的线程)的统计
+		static void snapshot(Snapshot& out) {
+			Registry* r = registry();
+
+			out.clear();
+			pthread_mutex_lock(&r->lock);
+			if (r->dead != NULL)
+				merge(out, *r->dead);
+			for (Local* l = r->head; l != NULL; l = l->next)
+				merge(out, l->s);
+			pthread_mutex_unlock(&r->lock);
+		}
+
+		// 加锁并记录等待时间, 返回取得锁的时刻, 交给unlock计算持有时间
+		static uint64_t lock(pthread_mutex_t* m, int wait) {
+			uint64_t b = now();
+			pthread_mutex_lock(m);
+			uint64_t t = now();
+			record(wait, t - b);
+			return t;
+		}
+
+		static void unlock(pthread_mutex_t* m, int hold, uint64_t since) {
+			record(hold, now() - since);
+			pthread_mutex_unlock(m);
+		}
+
+		static uint64_t lock(pthread_spinlock_t* m, int wait) {
+			uint64_t b = now();
+			pthread_spin_lock(m);
+			uint64_t t = now();
+			record(wait, t - b);
+			return t;
+		}
+
+		static void unlock(pthread_spinlock_t* m, int hold, uint64_t since) {
+			record(hold, now() - since);
+			pthread_spin_unlock(m);
+		}
+
+		// 在条件变量上等待, 分别记录此前持有锁的时间和阻塞的时间, 返回重新取得锁的时刻
+		static uint64_t wait(pthread_cond_t* cv, pthread_mutex_t* m, int hold, int blocked, uint64_t since) {
+			uint64_t b = now();
+			record(hold, b - since);
+			pthread_cond_wait(cv, m);
+			uint64_t t = now();
+			record(blocked, t - b);
+			return t;
+		}
+
+	private:
+		Stat();
+		Stat(const Stat&);
+		Stat& operator = (const Stat&);
+
+		struct Shard {
+			int64_t		c[Cmax];
+			Hist		h[Hmax];
+		};
+
+		// 线程的分片, 线程退出时并入dead
+		struct Local {
+			Shard		s;
+			Local*		prev;
+			Local*		next;
+
+			Local(): prev(NULL) {
+				memset(&s, 0, sizeof(s));
+
+				Registry* r = registry();
+				pthread_mutex_lock(&r->lock);
+				next = r->head;
+				if (next != NULL)
+					next->prev = this;
+				r->head = this;
+				pthread_mutex_unlock(&r->lock);
+			}
+
+			~Local() {
+				Registry* r = registry();
+				pthread_mutex_lock(&r->lock);
+				if (r->dead == NULL)
+					r->dead = new (std::nothrow) Shard();
+
+				if (r->dead != NULL) {
+					for (int i = 0; i < Cmax; i++)
+						r->dead->c[i] += s.c[i];
+					for (int i = 0; i < Hmax; i++)
+						mergeHist(r->dead->h[i], s.h[i]);
+				}
+
+				if (prev != NULL)
+					prev->next = next;
+				else
+					r->head = next;
+				if (next != NULL)
+					next->prev = prev;
+				pthread_mutex_unlock(&r->lock);
+			}
+		};
+
+		struct Registry {
+			pthread_mutex_t	lock;
+			Local*		head;
+			Shard*		dead;
+		};
+
+		// 常量初始化, 不依赖全局对象的构造顺序
+		static Registry* registry() {
+			static Registry r = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL};
+			return &r;
+		}
+
+		static void inc(uint64_t* p, uint64_t n) {
+			__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+		}
+
+		static int bucket(uint64_t v) {
+			if (v < (uint64_t)Sub)
+				return (int)v;
+
+			int e = 63 - __builtin_clzll(v);
+			int k = (e - 3) * Sub + (int)((v >> (e - 4)) & (Sub - 1));
+			return k < Buckets ? k : Buckets - 1;
+		}
+
+		static uint64_t upper(int k) {
+			if (k < Sub)
+				return (uint64_t)k;
+
+			int e = k / Sub + 3;
+			uint64_t low = (uint64_t)(Sub + k % Sub) << (e - 4);
+			return low + ((uint64_t)1 << (e - 4)) - 1;
+		}
+
+		static void mergeHist(Hist& to, const Hist& from) {
+			to.count += __atomic_load_n(&from.count, __ATOMIC_RELAXED);
+			to.sum += __atomic_load_n(&from.sum, __ATOMIC_RELAXED);
+
+			uint64_t m = __atomic_load_n(&from.max, __ATOMIC_RELAXED);
+			if (m > to.max)
+				to.max = m;
+
+			for (int k = 0; k < Buckets; k++)
+				to.b[k] += __atomic_load_n(&from.b[k], __ATOMIC_RELAXED);
+		}
+
+		static void merge(Snapshot& out, const Shard& s) {
+			for (int i = 0; i < Cmax; i++)
+				out.c[i] += __atomic_load_n(&s.c[i], __ATOMIC_RELAXED);
+			for (int i = 0; i < Hmax; i++)
+				mergeHist(out.h[i], s.h[i]);
+		}
+	};
+}
+
+#ifdef SMP_STAT
+#define SMP_STAT_ADD(c, n)	smp::Stat::add(smp::Stat::c, n)
+#define SMP_STAT_REC(h, v)	smp::Stat::record(smp::Stat::h, v)
+#else
+#define SMP_STAT_ADD(c, n)	((void)0)
+#define SMP_STAT_REC(h, v)	((void)0)
+#endif
+
+#endif
@@ -0,0 +1,308 @@
+//
+// 定时通道: 发送时指定时刻, 到期后才能被接收
+//
+// smp::Tchan<Job> q;
+// uint64_t id = q.after(job, 500);		// 500毫秒后可接收
+// q.cancel(id);					// 到期前撤销
+// q.send(job, smp::Tchan<Job>::now() + ns);	// 指定CLOCK_MONOTONIC的时刻(纳秒)
+// while (q >> job) ...				// 阻塞到最早的元素到期
+//
+// 按到期时刻组织为4叉堆, 堆中只保存时刻和槽号, 元素放在槽中不随堆调整移动
+// 接收者只在最早的到期时刻上做一次定时等待, 不定期轮询
+//
+
+#ifndef SMP_TICK_H
+#define SMP_TICK_H
+
+#include <ctime>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+namespace smp {
+	template<typename T>
+	class Tchan {
+	public:
+		// 默认容量不限, 指定容量时未到期的元素达到容量后发送会阻塞
+		Tchan(size_t capacity = 0): closed(false), waiting(0), seq(0), c(capacity) {
+			pthread_condattr_t attr;
+			pthread_condattr_init(&attr);
+			pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+			pthread_mutex_init(&qlock, NULL);
+			pthread_cond_init(&qmore, &attr);
+			pthread_cond_init(&qless, NULL);
+			pthread_condattr_destroy(&attr);
+		}
+
+		~Tchan() {
+			pthread_mutex_destroy(&qlock);
+			pthread_cond_destroy(&qmore);
+			pthread_cond_destroy(&qless);
+		}
+
+		// CLOCK_MONOTONIC, 纳秒
+		static uint64_t now() {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+
+		size_t len() {
+			pthread_mutex_lock(&qlock);
+			size_t len = heap.size();
+			pthread_mutex_unlock(&qlock);
+
+			return len;
+		}
+
+		size_t cap() {
+			return c;
+		}
+
+		// 最早的到期时刻, 没有元素时返回0
+		uint64_t next() {
+			pthread_mutex_lock(&qlock);
+			uint64_t t = heap.empty() ? 0 : heap[0].when;
+			pthread_mutex_unlock(&qlock);
+
+			return t;
+		}
+
+		// 在when(同now())之后可被接收, 同一时刻的元素按发送顺序接收
+		// 返回可用于cancel的编号, 通道已关闭返回0
+		uint64_t send(const T& item, uint64_t when) {
+			pthread_mutex_lock(&qlock);
+			while (!closed && c > 0 && heap.size() >= c)
+				pthread_cond_wait(&qless, &qlock);
+
+			if (closed) {
+				pthread_mutex_unlock(&qlock);
+				return 0;
+			}
+
+			uint32_t s;
+			if (!freed.empty()) {
+				s = freed.back();
+				freed.pop_back();
+			} else {
+				s = (uint32_t)slots.size();
+				slots.push_back(Slot());
+			}
+
+			Slot& sl = slots[s];
+			sl.item = item;
+			sl.gen++;
+
+			Key k = {when, seq++, s};
+			heap.push_back(k);
+			up(heap.size() - 1);
+
+			// 成为最早的元素时, 唤醒一个接收者按新的时刻重新等待
+			bool earliest = heap[0].slot == s;
+			uint64_t id = (uint64_t)sl.gen << 32 | s;
+			pthread_mutex_unlock(&qlock);
+
+			if (earliest)
+				pthread_cond_signal(&qmore);
+
+			return id;
+		}
+
+		// ms毫秒后可被接收
+		uint64_t after(const T& item, uint64_t ms) {
+			return send(item, now() + ms * 1000000ULL);
+		}
+
+		// 撤销尚未被接收的元素, 已接收、已撤销或编号无效时返回false
+		bool cancel(uint64_t id) {
+			uint32_t s = (uint32_t)id;
+			uint32_t gen = (uint32_t)(id >> 32);
+
+			pthread_mutex_lock(&qlock);
+			if (gen == 0 || s >= slots.size() || slots[s].gen != gen || slots[s].pos == Npos) {
+				pthread_mutex_unlock(&qlock);
+				return false;
+			}
+
+			remove(slots[s].pos);
+			pthread_mutex_unlock(&qlock);
+			pthread_cond_signal(&qless);
+
+			return true;
+		}
+
+		// 关闭通道, 不再接受发送; 已发送的元素仍在到期后被接收
+		void close() {
+			pthread_mutex_lock(&qlock);
+			closed = true;
+			pthread_mutex_unlock(&qlock);
+			pthread_cond_broadcast(&qmore);
+			pthread_cond_broadcast(&qless);
+		}
+
+		// 接收一个到期的元素, 没有到期的元素时等待到最早的到期时刻
+		// 通道已关闭且没有元素时返回false
+		bool operator >> (T& item) {
+			pthread_mutex_lock(&qlock);
+			while (true) {
+				if (!heap.empty()) {
+					uint64_t when = heap[0].when;
+					if (when <= now())
+						break;
+
+					struct timespec ts;
+					ts.tv_sec = when / 1000000000ULL;
+					ts.tv_nsec = when % 1000000000ULL;
+
+					waiting++;
+					pthread_cond_timedwait(&qmore, &qlock, &ts);
+					waiting--;
+					continue;
+				}
+
+				if (closed) {
+					pthread_mutex_unlock(&qlock);
+					return false;
+				}
+
+				waiting++;
+				pthread_cond_wait(&qmore, &qlock);
+				waiting--;
+			}
+
+			take(item);
+			return true;
+		}
+
+		// 不等待, 有到期的元素时取出并返回true
+		bool poll(T& item) {
+			pthread_mutex_lock(&qlock);
+			if (heap.empty() || heap[0].when > now()) {
+				pthread_mutex_unlock(&qlock);
+				return false;
+			}
+
+			take(item);
+			return true;
+		}
+
+	private:
+		Tchan(const Tchan&);
+		Tchan& operator = (const Tchan&);
+
+		static const size_t D	 = 4;
+		static const size_t Npos = (size_t)-1;
+
+		struct Key {
+			uint64_t	when;
+			uint64_t	seq;
+			uint32_t	slot;
+		};
+
+		struct Slot {
+			T		item;
+			size_t		pos;		// 在堆中的位置, 不在堆中为Npos
+			uint32_t	gen;		// 每次使用加1, 与槽号组成编号
+
+			Slot(): pos(Npos), gen(0) {
+			}
+		};
+
+		static bool before(const Key& a, const Key& b) {
+			return a.when < b.when || (a.when == b.when && a.seq < b.seq);
+		}
+
+		void place(size_t i, const Key& k) {
+			heap[i] = k;
+			slots[k.slot].pos = i;
+		}
+
+		void up(size_t i) {
+			Key k = heap[i];
+			while (i > 0) {
+				size_t p = (i - 1) / D;
+				if (!before(k, heap[p]))
+					break;
+
+				place(i, heap[p]);
+				i = p;
+			}
+			place(i, k);
+		}
+
+		void down(size_t i) {
+			Key k = heap[i];
+			size_t n = heap.size();
+
+			while (true) {
+				size_t first = i * D + 1;
+				if (first >= n)
+					break;
+
+				size_t last = first + D < n ? first + D : n;
+				size_t m = first;
+				for (size_t j = first + 1; j < last; j++)
+					if (before(heap[j], heap[m]))
+						m = j;
+
+				if (!before(heap[m], k))
+					break;
+
+				place(i, heap[m]);
+				i = m;
+			}
+			place(i, k);
+		}
+
+		// 从堆中删除位置i, 释放其槽
+		void remove(size_t i) {
+			uint32_t s = heap[i].slot;
+			Key last = heap.back();
+			heap.pop_back();
+
+			if (i < heap.size()) {
+				place(i, last);
+				if (i > 0 && before(last, heap[(i - 1) / D]))
+					up(i);
+				else
+					down(i);
+			}
+
+			slots[s].pos = Npos;
+			slots[s].item = T();
+			freed.push_back(s);
+		}
+
+		// 持有qlock且堆顶已到期时调用, 返回前释放
+		void take(T& item) {
+			item = slots[heap[0].slot].item;
+			remove(0);
+
+			// 还有元素时让另一个等待者按新的堆顶重新等待
+			bool more = !heap.empty() && waiting > 0;
+			pthread_mutex_unlock(&qlock);
+
+			pthread_cond_signal(&qless);
+			if (more)
+				pthread_cond_signal(&qmore);
+		}
+
+	private:
+		std::vector<Key>	heap;
+		std::vector<Slot>	slots;
+		std::vector<uint32_t>	freed;		// 空闲的槽
+
+		pthread_mutex_t		qlock;
+		pthread_cond_t		qmore;		// 基于CLOCK_MONOTONIC, 等待最早的到期时刻
+		pthread_cond_t		qless;
+
+		bool			closed;
+		int			waiting;	// 等待qmore的接收者数
+		uint64_t		seq;
+
+		const size_t		c;
+	};
+}
+
+#endif
@@ -0,0 +1,369 @@
+//
+// 把Ulog的二进制日志(ULOG_BIN)还原为文本
+//
+// udec app.bin [app.bin.1 ...]
+//
+// 格式记录可能出现在任意一个文件中(如日志轮转后的较早分段), 所以先读取全部文件中的格式记录,
+// 再依次还原每个文件中的事件记录
+// 调用点编号只在一次运行内有效, 格式按(会话号, 编号)匹配, 不同运行的文件可以一起还原
+//
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../ulog.h"
+
+namespace {
+	struct Fmt {
+		bool		ok;		// 格式串与签名一致
+		int		level;
+		uint32_t	line;
+		std::string	sig;
+		std::string	file;
+		std::string	fmt;
+	};
+
+	// 高32位为会话号, 低32位为调用点编号
+	typedef std::map<uint64_t, Fmt> Fmts;
+
+	uint64_t fmtKey(const smp::Ubin& h) {
+		return (uint64_t)h.session << 32 | h.id;
+	}
+
+	const char* const levelNames[] = {"ALL", "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL", "OFF"};
+
+	// 顺序读取事件参数, 越界后ok为false
+	struct Reader {
+		const char*	p;
+		const char*	e;
+		bool		ok;
+
+		template <typename T>
+		T get() {
+			T v = T();
+			if ((size_t)(e - p) < sizeof(T)) {
+				ok = false;
+				return v;
+			}
+
+			memcpy(&v, p, sizeof(T));
+			p += sizeof(T);
+			return v;
+		}
+
+		std::string str() {
+			uint32_t n = get<uint32_t>();
+			if (!ok || (size_t)(e - p) < n) {
+				ok = false;
+				return std::string();
+			}
+
+			std::string s(p, n);
+			p += n;
+			return s;
+		}
+	};
+
+	bool readFile(const char* name, std::string& data) {
+		int fd = open(name, O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		char buf[65536];
+		ssize_t n;
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			data.append(buf, n);
+
+		close(fd);
+		return n == 0;
+	}
+
+	template <typename T>
+	void put(std::string& out, const std::string& spec, const int* stars, int nstars, T v) {
+		std::vector<char> buf(256);
+
+		while (true) {
+			int n;
+			if (nstars == 0)
+				n = snprintf(&buf[0], buf.size(), spec.c_str(), v);
+			else if (nstars == 1)
+				n = snprintf(&buf[0], buf.size(), spec.c_str(), stars[0], v);
+			else
+				n = snprintf(&buf[0], buf.size(), spec.c_str(), stars[0], stars[1], v);
+
+			if (n < 0)
+				return;
+
+			if ((size_t)n < buf.size()) {
+				out.append(&buf[0], n);
+				return;
+			}
+
+			buf.resize(n + 1);
+		}
+	}
+
+	// 按与Ulog::signature相同的规则解析格式串, 每个转换都必须与签名一致, 否则记录可能已损坏或不匹配
+	// 不支持位置参数(%n$)和宽字符(%ls, %lc及未知的转换)
+	bool valid(const Fmt& f) {
+		std::string sig;
+
+		for (const char* c = f.fmt.c_str(); *c != '\0'; c++) {
+			if (*c != '%')
+				continue;
+			if (*++c == '%')
+				continue;
+
+			while (*c != '\0' && strchr("-+ #0'", *c) != NULL)
+				c++;
+			if (*c == '*') {
+				sig += 'i';
+				c++;
+			}
+			while (*c >= '0' && *c <= '9')
+				c++;
+			if (*c == '$')
+				return false;
+			if (*c == '.') {
+				c++;
+				if (*c == '*') {
+					sig += 'i';
+					c++;
+				}
+				while (*c >= '0' && *c <= '9')
+					c++;
+				if (*c == '$')
+					return false;
+			}
+
+			int longs = 0;
+			bool ld = false;
+			while (*c != '\0' && strchr("hlLqjzt", *c) != NULL) {
+				if (*c == 'l' || *c == 'z' || *c == 't')
+					longs++;
+				else if (*c == 'q' || *c == 'j')
+					longs = 2;
+				else if (*c == 'L')
+					ld = true;
+				c++;
+			}
+
+			switch (*c) {
+			case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+				sig += longs == 0 ? 'i' : (longs == 1 ? 'l' : 'q');
+				break;
+			case 'c':
+			case 's':
+				if (longs > 0)
+					return false;
+				sig += *c == 'c' ? 'i' : 's';
+				break;
+			case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+				sig += ld ? 'D' : 'd';
+				break;
+			case 'p': case 'n':
+				sig += 'p';
+				break;
+			default:
+				return false;
+			}
+		}
+
+		return sig == f.sig;
+	}
+
+	// 按格式串和签名把参数还原为文本, 格式串需先经valid检查, 参数不完整时返回false
+	bool format(const Fmt& f, Reader& r, std::string& out) {
+		const char* c = f.fmt.c_str();
+		size_t k = 0;
+
+		while (*c != '\0') {
+			if (*c != '%') {
+				out += *c++;
+				continue;
+			}
+
+			if (c[1] == '%') {
+				out += '%';
+				c += 2;
+				continue;
+			}
+
+			const char* b = c++;
+			int stars[2];
+			int nstars = 0;
+
+			while (*c != '\0' && strchr("-+ #0'", *c) != NULL)
+				c++;
+			if (*c == '*') {
+				stars[nstars++] = r.get<int>();
+				k++;
+				c++;
+			}
+			while (*c >= '0' && *c <= '9')
+				c++;
+			if (*c == '.') {
+				c++;
+				if (*c == '*') {
+					stars[nstars++] = r.get<int>();
+					k++;
+					c++;
+				}
+				while (*c >= '0' && *c <= '9')
+					c++;
+			}
+			while (*c != '\0' && strchr("hlLqjzt", *c) != NULL)
+				c++;
+			if (*c == '\0' || k >= f.sig.size())
+				break;
+
+			std::string spec(b, ++c - b);
+			switch (f.sig[k++]) {
+			case 'i': put(out, spec, stars, nstars, r.get<int>()); break;
+			case 'l': put(out, spec, stars, nstars, r.get<long>()); break;
+			case 'q': put(out, spec, stars, nstars, r.get<long long>()); break;
+			case 'd': put(out, spec, stars, nstars, r.get<double>()); break;
+			case 'D': put(out, spec, stars, nstars, r.get<long double>()); break;
+			case 's': put(out, spec, stars, nstars, r.str().c_str()); break;
+			case 'p':
+				// %n不还原
+				if (c[-1] == 'p')
+					put(out, spec, stars, nstars, r.get<void*>());
+				else
+					r.get<void*>();
+				break;
+			}
+
+			if (!r.ok)
+				return false;
+		}
+
+		return r.ok;
+	}
+
+	// 遍历文件中的记录, 格式错误时返回false
+	template <typename F>
+	bool walk(const std::string& data, F& f) {
+		size_t off = 0;
+
+		while (off + sizeof(smp::Ubin) <= data.size()) {
+			smp::Ubin h;
+			memcpy(&h, data.data() + off, sizeof(h));
+
+			// Fsink未正常关闭时分段末尾是预分配的0
+			if (h.len == 0 && h.magic == 0)
+				return true;
+
+			if (h.magic != smp::Ubin::Magic || h.len < sizeof(h) || h.len > data.size() - off) {
+				fprintf(stderr, "udec: bad record at offset %lu\n", (unsigned long)off);
+				return false;
+			}
+
+			f(h, data.data() + off + sizeof(h), h.len - sizeof(h));
+			off += h.len;
+		}
+
+		return off == data.size();
+	}
+
+	struct Collect {
+		Fmts* fmts;
+
+		void operator () (const smp::Ubin& h, const char* p, size_t n) {
+			if (h.kind != smp::Ubin::Kfmt || n < sizeof(uint32_t))
+				return;
+
+			Fmt f;
+			const char* e = p + n;
+			f.level = h.level;
+			memcpy(&f.line, p, sizeof(f.line));
+			p += sizeof(f.line);
+
+			std::string* parts[3] = {&f.sig, &f.file, &f.fmt};
+			for (int i = 0; i < 3; i++) {
+				const char* z = (const char*)memchr(p, '\0', e - p);
+				if (z == NULL)
+					return;
+
+				parts[i]->assign(p, z - p);
+				p = z + 1;
+			}
+
+			f.ok = valid(f);
+			(*fmts)[fmtKey(h)] = f;
+		}
+	};
+
+	struct Print {
+		const Fmts* fmts;
+		std::string out;
+
+		void operator () (const smp::Ubin& h, const char* p, size_t n) {
+			if (h.kind != smp::Ubin::Kevent)
+				return;
+
+			char stamp[64];
+			time_t sec = (time_t)(h.ts / 1000000000ULL);
+			struct tm st_tm;
+			localtime_r(&sec, &st_tm);
+			size_t k = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &st_tm);
+			snprintf(stamp + k, sizeof(stamp) - k, ".%06lu [%s] ", (unsigned long)(h.ts % 1000000000ULL / 1000),
+					h.level < 8 ? levelNames[h.level] : "?");
+
+			out = stamp;
+
+			Fmts::const_iterator it = fmts->find(fmtKey(h));
+			if (it == fmts->end()) {
+				char b[64];
+				snprintf(b, sizeof(b), "<unknown format %u in session %08x>\n", h.id, h.session);
+				out += b;
+			} else if (!it->second.ok) {
+				char b[64];
+				snprintf(b, sizeof(b), "<bad format %u in session %08x>\n", h.id, h.session);
+				out += b;
+			} else {
+				Reader r = {p, p + n, true};
+				if (!format(it->second, r, out))
+					out += "<truncated>\n";
+			}
+
+			fwrite(out.data(), 1, out.size(), stdout);
+		}
+	};
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<std::string> data(argc > 1 ? argc - 1 : 0);
+	Fmts fmts;
+	int ret = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s file...\n", argv[0]);
+		return 2;
+	}
+
+	Collect collect = {&fmts};
+	for (int i = 1; i < argc; i++) {
+		if (!readFile(argv[i], data[i - 1])) {
+			fprintf(stderr, "udec: cannot read %s\n", argv[i]);
+			return 1;
+		}
+
+		walk(data[i - 1], collect);
+	}
+
+	Print print;
+	print.fmts = &fmts;
+	for (size_t i = 0; i < data.size(); i++) {
+		if (!walk(data[i], print))
+			ret = 1;
+	}
+
+	return ret;
+}
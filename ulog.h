@@ -8,12 +8,77 @@
 
 #include <new>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cstdarg>
+#include <cerrno>
+#include <climits>
+#include <ctime>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include <string>
+#include <vector>
+
+#include "sink.h"
+#include "stat.h"
 
 namespace smp {
-	template<size_t N>
+	// 二进制日志的记录头, 所有字段按本机字节序
+	// 调用点编号只在一个进程内有效, 还原时按(session, id)匹配格式记录
+	// Kfmt记录之后依次是: 行号(uint32_t), 参数签名, 文件名, 格式串, 均以'\0'结尾
+	// Kevent记录之后是按签名依次存放的参数: 'i' int, 'l' long, 'q' long long, 'd' double,
+	// 'D' long double, 'p' void*, 's' uint32_t长度加字节(不含'\0')
+	struct Ubin {
+		static const uint16_t Magic = 0xb10c;
+		static const uint8_t Kfmt = 1;
+		static const uint8_t Kevent = 2;
+
+		uint32_t	len;		// 整条记录的长度, 含记录头
+		uint16_t	magic;
+		uint8_t		kind;
+		uint8_t		level;
+		uint32_t	id;		// 调用点编号
+		uint32_t	session;	// 进程启动时随机生成, 区分不同运行写入的记录
+		uint64_t	ts;		// CLOCK_REALTIME, 纳秒
+	};
+
+	// 调用点的限流状态, 作为静态变量放在调用点(见ULOG_LIMIT/ULOG_SAMPLE), 零初始化即可使用
+	struct Ulimit {
+		uint64_t	window;		// 当前窗口的开始时间(毫秒)
+		uint32_t	count;		// 窗口内的调用次数
+		uint32_t	suppressed;	// 上次输出后被抑制的次数
+
+		// 每ms毫秒最多n次, 抑制时返回-1, 否则返回此前被抑制的次数
+		long take(uint32_t n, uint32_t ms) {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+			uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+			uint64_t w = __atomic_load_n(&window, __ATOMIC_RELAXED);
+			if (now - w >= ms && __atomic_compare_exchange_n(&window, &w, now, false,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				__atomic_store_n(&count, 0, __ATOMIC_RELAXED);
+
+			if (__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED) > n) {
+				__atomic_add_fetch(&suppressed, 1, __ATOMIC_RELAXED);
+				return -1;
+			}
+
+			return __atomic_exchange_n(&suppressed, 0, __ATOMIC_RELAXED);
+		}
+
+		// 每k次取1次
+		bool sample(uint32_t k) {
+			return k <= 1 || (__atomic_fetch_add(&count, 1, __ATOMIC_RELAXED) % k) == 0;
+		}
+	};
+
+	// N: 每条日志的最大长度
+	// M: 编译期最低级别, 低于M的日志调用在编译时被整体消除, 如发布版本使用Ulog<4096, Ulog<4096>::Linfo>
+	template<size_t N, int M = 0>
 	class Ulog {
 	public:
 		static const int Lall	= 0;
@@ -24,6 +89,7 @@ namespace smp {
 		static const int Lerror	= 5;
 		static const int Lfatal = 6;
 		static const int Loff	= 7;
+		static const int Linherit = -1;			// 子日志使用上级的级别
 
 		static const int Fnone	= 0x00;
 		static const int Fdate	= 0x01;
@@ -31,8 +97,17 @@ namespace smp {
 		static const int Fthrid	= 0x04;			// 线程标号
 		static const int Fthrnm = 0x08;			// 线程名称, 需setThreadName
 		static const int Flevel	= 0x10;
+		static const int Fmsec	= 0x20;			// 时间带毫秒, 需Ftime
+		static const int Fusec	= 0x40;			// 时间带微秒, 需Ftime
 		static const int Fstd	= Fdate | Ftime;
 
+		// 异步模式下线程的环满时的处理
+		static const int Pblock = 0;			// 等待后台线程写出
+		static const int Pdrop	= 1;			// 丢弃并计数
+		static const int Pspill = 2;			// 绕过环直接同步写出
+
+		static const size_t Omax = 8;			// 每个日志的最大输出数
+
 		// 当所有使用者线程都退出时，调用此函数释放key
 		// 如不释放也没关系
 		static void clean() {
@@ -40,31 +115,179 @@ namespace smp {
 		}
 
 	public:
-		Ulog(): level(Lall), flags(Fstd), logfd(1) {
-			pthread_rwlock_init(&lock, NULL);
+		Ulog(): level(Lall), flags(Fstd), routes(NULL), async(NULL), announced(0), bin(0), parent(NULL), root(this),
+				phase(0), busy(&solo), nbusy(1) {
+			solo.n[0] = solo.n[1] = 0;
+			pthread_mutex_init(&cfg, NULL);
 			pthread_once(&once_create, key_create);
+
+			// 分配失败时所有读者共用solo
+			void* mem = NULL;
+			long cpus = sysconf(_SC_NPROCESSORS_CONF);
+			size_t cnt = cpus > 1 ? (size_t)cpus : 1;
+			if (cnt > 1 && posix_memalign(&mem, 64, cnt * sizeof(Busy)) == 0) {
+				busy = (Busy*)mem;
+				nbusy = cnt;
+				for (size_t i = 0; i < cnt; i++)
+					busy[i].n[0] = busy[i].n[1] = 0;
+			}
+
+			try {
+				routes = new Routes();
+				routes->n = 1;
+				routes->r[0].sink = NULL;
+				routes->r[0].fd = 1;
+				routes->r[0].level = Lall;
+			} catch (const std::bad_alloc& e) {
+			}
 		}
 
 		~Ulog() {
-			pthread_rwlock_destroy(&lock);
+			// 环中的记录可能来自子日志, 先写完再销毁子日志
+			stopAsync();
+
+			for (size_t i = 0; i < children.size(); i++)
+				delete children[i];
+
+			delete routes;
+			if (busy != &solo)
+				::free(busy);
+			pthread_mutex_destroy(&cfg);
+		}
+
+		// 名为name的子日志, 不存在时创建; 子日志有自己的级别和输出, 未设置时使用上级的,
+		// 输出时在级别之后带上[name], 随上级一起销毁
+		Ulog* child(const char* name) {
+			Ulog* c = NULL;
+
+			pthread_mutex_lock(&root->cfg);
+			try {
+				std::string full = parent != NULL ? this->name + "." + name : std::string(name);
+				for (size_t i = 0; i < children.size() && c == NULL; i++) {
+					if (children[i]->name == full)
+						c = children[i];
+				}
+
+				if (c == NULL) {
+					children.reserve(children.size() + 1);
+					c = new Ulog(this, full);
+					children.push_back(c);
+				}
+			} catch (const std::bad_alloc& e) {
+				c = NULL;
+			}
+			pthread_mutex_unlock(&root->cfg);
+
+			return c;
+		}
+
+		const std::string& getName() const {
+			return name;
+		}
+
+		// 切换到异步模式: 每个线程把格式化好的日志追加到自己的环(单生产者单消费者),
+		// 后台线程把所有环按时间顺序合并, 用writev批量写出
+		// size为每个线程的环大小(字节), policy为环满时的处理, 只能调用一次
+		bool setAsync(size_t size = 1 << 20, int policy = Pblock) {
+			Async* a = NULL;
+
+			if (parent != NULL || __atomic_load_n(&async, __ATOMIC_ACQUIRE) != NULL)
+				return false;
+
+			try {
+				a = new Async();
+			} catch (const std::bad_alloc& e) {
+				return false;
+			}
+
+			a->cap = 4096;
+			while (a->cap < size)
+				a->cap <<= 1;
+			a->policy = policy;
+
+			if (pthread_key_create(&a->key, detach) != 0) {
+				delete a;
+				return false;
+			}
+
+			if (pthread_create(&a->tid, NULL, writer, this) != 0) {
+				pthread_key_delete(a->key);
+				delete a;
+				return false;
+			}
+
+			__atomic_store_n(&async, a, __ATOMIC_RELEASE);
+			return true;
+		}
+
+		// 等待此前所有线程写入环的日志都已写出, 同步模式下直接返回
+		void flush() {
+			Async* a = __atomic_load_n(&root->async, __ATOMIC_ACQUIRE);
+			if (a == NULL)
+				return;
+
+			pthread_mutex_lock(&a->lock);
+			unsigned long t = ++a->flushReq;
+			pthread_cond_signal(&a->wake);
+			while (a->flushDone < t)
+				pthread_cond_wait(&a->done, &a->lock);
+			pthread_mutex_unlock(&a->lock);
+		}
+
+		// Pdrop策略下被丢弃的日志条数
+		unsigned long dropped() {
+			Async* a = __atomic_load_n(&root->async, __ATOMIC_ACQUIRE);
+			return a == NULL ? 0 : __atomic_load_n(&a->dropped, __ATOMIC_RELAXED);
 		}
 
+		// 子日志可以设为Linherit
 		void setLogLevel(int logLevel) {
-			pthread_rwlock_wrlock(&lock);
-			level = (logLevel >= Lall && logLevel <= Loff) ? logLevel : Loff;
-			pthread_rwlock_unlock(&lock);
+			if (logLevel == Linherit && parent == NULL)
+				logLevel = Lall;
+			else if (logLevel != Linherit && (logLevel < Lall || logLevel > Loff))
+				logLevel = Loff;
+
+			__atomic_store_n(&level, logLevel, __ATOMIC_RELAXED);
+		}
+
+		// 级别是否输出, 只有原子读; lv为常量且低于M时编译为false
+		bool enabled(int lv) const {
+			return lv >= M && lv >= effective();
+		}
+
+		// 以下设置输出的函数返回后, 不再有写入使用原来的输出, 可以关闭或销毁
+		bool setOutput(int fd) {
+			Route r = {NULL, fd, Lall, 0};
+			return reroute(&r, false);
+		}
+
+		// 输出到s, 如Fsink
+		bool setOutput(Sink* s) {
+			Route r = {s, -1, Lall, 0};
+			return reroute(&r, false);
+		}
+
+		// 增加一个输出, 只接收不低于minLevel的日志, 如单独输出错误
+		// 子日志尚无自己的输出时, 以上级当前的输出为基础
+		bool addOutput(int fd, int minLevel = Lall) {
+			Route r = {NULL, fd, minLevel, 0};
+			return reroute(&r, true);
+		}
+
+		bool addOutput(Sink* s, int minLevel = Lall) {
+			Route r = {s, -1, minLevel, 0};
+			return reroute(&r, true);
 		}
 
-		void setOutput(int fd) {
-			pthread_rwlock_wrlock(&lock);
-			logfd = fd;
-			pthread_rwlock_unlock(&lock);
+		// 子日志恢复使用上级的输出
+		void inheritOutput() {
+			if (parent != NULL)
+				update(NULL);
 		}
 
+		// 对整棵日志树生效
 		void setFlags(int flag) {
-			pthread_rwlock_wrlock(&lock);
-			flags = flag;
-			pthread_rwlock_unlock(&lock);
+			__atomic_store_n(&root->flags, flag, __ATOMIC_RELAXED);
 		}
 
 		void setThreadName(const char* name) {
@@ -84,14 +307,10 @@ namespace smp {
 			p->longer = true;
 			p->longer_level = (logLevel >= Lall && logLevel <= Loff) ? logLevel : Loff;
 
-			pthread_rwlock_rdlock(&lock);
-			if (p->longer_level < logLevel) {
-				pthread_rwlock_unlock(&lock);
+			if (!enabled(p->longer_level))
 				return;
-			}
 
 			logprefix(p, levelNames[p->longer_level]);
-			pthread_rwlock_unlock(&lock);
 		}
 
 		void print(const char *format, ...) {
@@ -109,22 +328,31 @@ namespace smp {
 			if (!p->longer)
 				return;
 
-			pthread_rwlock_rdlock(&lock);
-			if (p->longer_level < level) {
-				pthread_rwlock_unlock(&lock);
-
+			if (!enabled(p->longer_level)) {
 				p->len = 0;
 				p->longer = false;
 				return;
 			}
 
-			logwrite(logfd, p);
-			pthread_rwlock_unlock(&lock);
+			logwrite(p, p->longer_level);
 			p->longer = false;
 		}
 
-		// 较短日志，立即发送
+		// 较短日志，立即发送, message的级别由参数指定
+		void message(int lv, const char* format, ...) {
+			if (lv < Ltrace || lv > Lfatal || !enabled(lv))
+				return;
+
+			va_list args;
+			va_start(args, format);
+			logshorter(lv, format, args);
+			va_end(args);
+		}
+
 		void trace(const char* format, ...) {
+			if (!enabled(Ltrace))
+				return;
+
 			va_list args;
 			va_start(args, format);
 			logshorter(Ltrace, format, args);
@@ -132,6 +360,9 @@ namespace smp {
 		}
 
 		void debug(const char* format, ...) {
+			if (!enabled(Ldebug))
+				return;
+
 			va_list args;
 			va_start(args, format);
 			logshorter(Ldebug, format, args);
@@ -139,6 +370,9 @@ namespace smp {
 		}
 
 		void info(const char* format, ...) {
+			if (!enabled(Linfo))
+				return;
+
 			va_list args;
 			va_start(args, format);
 			logshorter(Linfo, format, args);
@@ -146,6 +380,9 @@ namespace smp {
 		}
 
 		void warn(const char* format, ...) {
+			if (!enabled(Lwarn))
+				return;
+
 			va_list args;
 			va_start(args, format);
 			logshorter(Lwarn, format, args);
@@ -153,6 +390,9 @@ namespace smp {
 		}
 
 		void error(const char* format, ...) {
+			if (!enabled(Lerror))
+				return;
+
 			va_list args;
 			va_start(args, format);
 			logshorter(Lerror, format, args);
@@ -160,25 +400,327 @@ namespace smp {
 		}
 
 		void fatal(const char* format, ...) {
+			if (!enabled(Lfatal))
+				return;
+
 			va_list args;
 			va_start(args, format);
 			logshorter(Lfatal, format, args);
 			va_end(args);
 		}
 
+		// 二进制模式: 每个调用点的格式串只登记一次, 之后只写入编号、时间戳和参数的原始字节,
+		// 不做格式化, 由tools/udec离线还原为文本
+		// 同一Ulog不要混用文本和二进制日志, 也不能在begin()/end()之间使用, 一般通过ULOG_BIN调用
+		struct Site {
+			uint32_t	id;
+			uint32_t	session;
+			int		level;
+			int		line;
+			size_t		fixed;		// 除字符串内容外参数占用的字节数
+			std::string	sig;
+			std::string	file;
+			std::string	fmt;
+		};
+
+		// 登记调用点, 解析格式串得到参数签名, 失败返回NULL
+		static const Site* bind(int lv, const char* fmt, const char* file, int line) {
+			Site* s = NULL;
+
+			try {
+				s = new Site();
+				s->level = lv;
+				s->line = line;
+				s->file = file;
+				s->fmt = fmt;
+				s->sig = signature(fmt);
+			} catch (const std::bad_alloc& e) {
+				delete s;
+				return NULL;
+			}
+
+			s->fixed = 0;
+			for (size_t i = 0; i < s->sig.size(); i++)
+				s->fixed += argSize(s->sig[i]);
+
+			if (sizeof(Ubin) + s->fixed > N) {
+				delete s;
+				return NULL;
+			}
+
+			bool ok = true;
+			pthread_mutex_lock(&siteLock);
+			try {
+				if (sites == NULL) {
+					sites = new std::vector<Site*>();
+					session = newSession();
+				}
+				s->id = (uint32_t)sites->size();
+				s->session = session;
+				sites->push_back(s);
+			} catch (const std::bad_alloc& e) {
+				ok = false;
+			}
+			pthread_mutex_unlock(&siteLock);
+
+			if (!ok) {
+				delete s;
+				return NULL;
+			}
+
+			return s;
+		}
+
+		static const Site* site(const void* p) {
+			return (const Site*)p;
+		}
+
+		void binary(const Site* site, ...) {
+			if (site == NULL || !enabled(site->level))
+				return;
+
+			Buffer* p = getBuffer();
+			if (p == NULL || p->longer)
+				return;
+
+			if (!__atomic_load_n(&root->bin, __ATOMIC_RELAXED))
+				__atomic_store_n(&root->bin, 1, __ATOMIC_RELAXED);
+
+			if (site->id >= __atomic_load_n(&announced, __ATOMIC_ACQUIRE))
+				announce(p);
+
+			Ubin* h = (Ubin*)p->buf;
+			h->magic = Ubin::Magic;
+			h->kind = Ubin::Kevent;
+			h->level = (uint8_t)site->level;
+			h->id = site->id;
+			h->session = site->session;
+			h->ts = now();
+
+			// 字符串共用固定参数之外的空间, 超出部分被截断
+			char* d = p->buf + sizeof(Ubin);
+			size_t room = N - sizeof(Ubin) - site->fixed;
+
+			va_list args;
+			va_start(args, site);
+			for (const char* c = site->sig.c_str(); *c != '\0'; c++) {
+				switch (*c) {
+				case 'i': { int v = va_arg(args, int); memcpy(d, &v, sizeof(v)); d += sizeof(v); break; }
+				case 'l': { long v = va_arg(args, long); memcpy(d, &v, sizeof(v)); d += sizeof(v); break; }
+				case 'q': { long long v = va_arg(args, long long); memcpy(d, &v, sizeof(v)); d += sizeof(v); break; }
+				case 'd': { double v = va_arg(args, double); memcpy(d, &v, sizeof(v)); d += sizeof(v); break; }
+				case 'D': { long double v = va_arg(args, long double); memcpy(d, &v, sizeof(v)); d += sizeof(v); break; }
+				case 'p': { void* v = va_arg(args, void*); memcpy(d, &v, sizeof(v)); d += sizeof(v); break; }
+				case 's': {
+					const char* v = va_arg(args, const char*);
+					if (v == NULL)
+						v = "(null)";
+
+					size_t n = strlen(v);
+					if (n > room)
+						n = room;
+					room -= n;
+
+					uint32_t k = (uint32_t)n;
+					memcpy(d, &k, sizeof(k));
+					memcpy(d + sizeof(k), v, n);
+					d += sizeof(k) + n;
+					break;
+				}
+				}
+			}
+			va_end(args);
+
+			h->len = (uint32_t)(d - p->buf);
+			p->len = h->len;
+
+			logwrite(p, site->level, h->ts);
+		}
+
 	private:
-		int level;
-		int flags;
-		int logfd;
-		pthread_rwlock_t lock;
+		struct Async;
+
+		// 一个输出, sink为NULL时写fd
+		struct Route {
+			Sink*	sink;
+			int	fd;
+			int	level;
+			mutable unsigned long gen;	// 最近一次写出全部格式记录时sink的代数
+		};
+
+		// 输出表, 发布后不再修改, 替换后等待使用者退出再释放
+		struct Routes {
+			size_t	n;
+			Route	r[Omax];
+		};
+
+		int level;			// 原子读写, 子日志可以为Linherit
+		int flags;			// 只使用根日志的
+		Routes* routes;			// 子日志为NULL时使用上级的
+		Async* async;			// 只有根日志有
+		uint32_t announced;		// 已写出格式记录的调用点数
+		int bin;			// 只使用根日志的: 树中写过二进制日志, 换输出时需补写格式记录
+
+		Ulog* parent;
+		Ulog* root;
+		std::string name;
+		std::vector<Ulog*> children;
+
+		// 读者登记按CPU分片, 各自占一个缓存行, 写日志的线程之间不争用
+		struct Busy {
+			unsigned long n[2];
+		} __attribute__((aligned(64)));
+
+		// 以下只使用根日志的: cfg串行化整棵树的配置修改,
+		// 读取输出表时在当前CPU分片的n[phase]中登记, 替换输出表后翻转phase并等待所有分片旧阶段的登记清零
+		pthread_mutex_t cfg;
+		unsigned phase;
+		Busy* busy;
+		size_t nbusy;
+		Busy solo;
 
 	private:
 		Ulog(const Ulog&);
 		Ulog& operator = (Ulog&);
 
+		Ulog(Ulog* parent, const std::string& name): level(Linherit), flags(Fstd), routes(NULL), async(NULL),
+				announced(0), bin(0), parent(parent), root(parent->root), name(name), phase(0), busy(&solo), nbusy(1) {
+			solo.n[0] = solo.n[1] = 0;
+			pthread_mutex_init(&cfg, NULL);
+		}
+
+		int effective() const {
+			const Ulog* l = this;
+			int v;
+
+			while ((v = __atomic_load_n(&l->level, __ATOMIC_RELAXED)) == Linherit)
+				l = l->parent;
+
+			return v;
+		}
+
+		// 生效的输出表, 调用者已经enter()
+		const Routes* current() const {
+			const Ulog* l = this;
+			const Routes* r;
+
+			while ((r = __atomic_load_n(&l->routes, __ATOMIC_ACQUIRE)) == NULL && l->parent != NULL)
+				l = l->parent;
+
+			return r;
+		}
+
+		// 返回的登记号为分片序号*2+阶段, 线程可能在期间迁移到其他CPU, leave()按登记号减回原分片
+		unsigned enter() const {
+			Ulog* r = root;
+			unsigned k = 0;
+
+			if (r->nbusy > 1) {
+				int cpu = sched_getcpu();
+				k = cpu > 0 ? (unsigned)cpu % r->nbusy : 0;
+			}
+
+			while (true) {
+				unsigned ph = __atomic_load_n(&r->phase, __ATOMIC_SEQ_CST) & 1;
+				__atomic_add_fetch(&r->busy[k].n[ph], 1, __ATOMIC_SEQ_CST);
+				if ((__atomic_load_n(&r->phase, __ATOMIC_SEQ_CST) & 1) == ph)
+					return k << 1 | ph;
+
+				__atomic_sub_fetch(&r->busy[k].n[ph], 1, __ATOMIC_RELEASE);
+			}
+		}
+
+		void leave(unsigned id) const {
+			__atomic_sub_fetch(&root->busy[id >> 1].n[id & 1], 1, __ATOMIC_RELEASE);
+		}
+
+		// 等待所有分片中阶段ph的登记清零, 读者很快退出, 先让出几次, 之后逐步延长睡眠
+		void drainPhase(unsigned ph) const {
+			struct timespec ts = {0, 50000};
+			int spins = 0;
+
+			for (size_t i = 0; i < root->nbusy; i++) {
+				while (__atomic_load_n(&root->busy[i].n[ph], __ATOMIC_SEQ_CST) != 0) {
+					if (spins++ < 16) {
+						sched_yield();
+						continue;
+					}
+
+					nanosleep(&ts, NULL);
+					if (ts.tv_nsec < 1000000)
+						ts.tv_nsec *= 2;
+				}
+			}
+		}
+
+		// 替换输出表(可以为NULL), 返回时旧表已无人使用并被释放, 调用者持有root->cfg
+		void replace(Routes* nr) {
+			Routes* old = __atomic_exchange_n(&routes, nr, __ATOMIC_SEQ_CST);
+
+			unsigned ph = __atomic_fetch_add(&root->phase, 1, __ATOMIC_SEQ_CST) & 1;
+			drainPhase(ph);
+
+			delete old;
+
+			// 新的输出没有见过此前登记的调用点, 立即补写全部格式记录, 之后的事件记录都能还原
+			const Routes* rt = current();
+			if (__atomic_load_n(&root->bin, __ATOMIC_RELAXED) && rt != NULL) {
+				for (size_t i = 0; i < rt->n; i++) {
+					const Route& r = rt->r[i];
+					__atomic_store_n(&r.gen, r.sink != NULL ? r.sink->generation() : 0, __ATOMIC_RELEASE);
+					describe(r);
+				}
+			}
+		}
+
+		// 异步模式下记录在写出时才路由, 先写完此前的日志, 使它们仍发往原来的输出
+		void update(Routes* nr) {
+			flush();
+
+			pthread_mutex_lock(&root->cfg);
+			replace(nr);
+			pthread_mutex_unlock(&root->cfg);
+		}
+
+		// add为false时只保留r, 否则追加到当前生效的输出表
+		bool reroute(const Route* r, bool add) {
+			Routes* nr = NULL;
+
+			flush();
+
+			pthread_mutex_lock(&root->cfg);
+			try {
+				nr = new Routes();
+			} catch (const std::bad_alloc& e) {
+				pthread_mutex_unlock(&root->cfg);
+				return false;
+			}
+
+			nr->n = 0;
+			if (add) {
+				const Routes* base = current();
+				if (base != NULL)
+					*nr = *base;
+			}
+
+			if (nr->n >= Omax) {
+				pthread_mutex_unlock(&root->cfg);
+				delete nr;
+				return false;
+			}
+
+			nr->r[nr->n] = *r;
+			nr->r[nr->n].gen = r->sink != NULL ? r->sink->generation() : 0;
+			nr->n++;
+			replace(nr);
+			pthread_mutex_unlock(&root->cfg);
+
+			return true;
+		}
+
 	private:
 		struct Buffer {
-			Buffer(): len(0), longer(false) {
+			Buffer(): len(0), longer(false), stamp(-1), stampFlags(0), stampLen(0) {
 			}
 
 			char	buf[N];
@@ -188,6 +730,12 @@ namespace smp {
 			int	longer_level;
 
 			std::string threadName;
+
+			// 缓存的日期时间前缀, 秒数或格式变化时才重新生成
+			time_t	stamp;
+			int	stampFlags;
+			int	stampLen;
+			char	stampBuf[24];
 		};
 
 		Buffer* getBuffer() {
@@ -205,54 +753,585 @@ namespace smp {
 			return p;
 		}
 
-		void logprefix(Buffer* p, const char* lvname) {
+		// 以width位(不足补0)写出v, 返回写出的末尾
+		static char* digits(char* d, unsigned long v, int width) {
+			char t[24];
 			int n = 0;
-			time_t timep;
+
+			do {
+				t[n++] = (char)('0' + v % 10);
+				v /= 10;
+			} while (v != 0);
+
+			while (n < width)
+				t[n++] = '0';
+
+			while (n > 0)
+				*d++ = t[--n];
+
+			return d;
+		}
+
+		static void append(Buffer* p, const char* s, size_t n) {
+			if (n < N - p->len) {
+				memcpy(p->buf + p->len, s, n);
+				p->len += n;
+			}
+		}
+
+		static void stampBuild(Buffer* p, time_t sec, int f) {
 			struct tm st_tm;
+			char* d = p->stampBuf;
 
-			if (flags & Fdate || flags & Ftime) {
-				time(&timep);
-				localtime_r(&timep, &st_tm);
+			localtime_r(&sec, &st_tm);
+
+			if (f & Fdate) {
+				d = digits(d, 1900 + st_tm.tm_year, 4);
+				*d++ = '-';
+				d = digits(d, 1 + st_tm.tm_mon, 2);
+				*d++ = '-';
+				d = digits(d, st_tm.tm_mday, 2);
+				*d++ = ' ';
 			}
 
-			if (flags & Fdate) {
-				n = snprintf(p->buf + p->len, N - p->len, "%04d-%02d-%02d ", (1900 + st_tm.tm_year),
-							(1 + st_tm.tm_mon), st_tm.tm_mday);
-				if (n > 0 && n < N - p->len)
-					p->len += n;
+			if (f & Ftime) {
+				d = digits(d, st_tm.tm_hour, 2);
+				*d++ = ':';
+				d = digits(d, st_tm.tm_min, 2);
+				*d++ = ':';
+				d = digits(d, st_tm.tm_sec, 2);
+				*d++ = ' ';
 			}
 
-			if (flags & Ftime) {
-				n = snprintf(p->buf + p->len, N - p->len, "%02d:%02d:%02d ", st_tm.tm_hour,
-							st_tm.tm_min, st_tm.tm_sec);
-				if (n > 0 && n < N - p->len)
-					p->len += n;
+			p->stamp = sec;
+			p->stampFlags = f;
+			p->stampLen = d - p->stampBuf;
+		}
+
+		void logprefix(Buffer* p, const char* lvname) {
+			char t[32];
+			char* d;
+			int f = __atomic_load_n(&root->flags, __ATOMIC_RELAXED);
+
+			if (f & (Fdate | Ftime)) {
+				struct timespec ts;
+
+				// 粗粒度时钟不进内核也不读硬件时钟, 精度为一个时钟节拍, 足够毫秒使用
+				clock_gettime((f & Ftime) && (f & Fusec) ? CLOCK_REALTIME : CLOCK_REALTIME_COARSE, &ts);
+
+				int sf = f & (Fdate | Ftime);
+				if (ts.tv_sec != p->stamp || sf != p->stampFlags)
+					stampBuild(p, ts.tv_sec, sf);
+
+				append(p, p->stampBuf, p->stampLen);
+
+				if ((f & Ftime) && (f & (Fmsec | Fusec)) && p->len > 0 && p->buf[p->len - 1] == ' ') {
+					d = t;
+					*d++ = '.';
+					if (f & Fusec)
+						d = digits(d, ts.tv_nsec / 1000, 6);
+					else
+						d = digits(d, ts.tv_nsec / 1000000, 3);
+					*d++ = ' ';
+
+					p->len--;
+					append(p, t, d - t);
+				}
+			}
+
+			if (f & Fthrid) {
+				d = t;
+				*d++ = '[';
+				d = digits(d, (unsigned long)pthread_self(), 1);
+				*d++ = ']';
+				*d++ = ' ';
+				append(p, t, d - t);
 			}
 
-			if (flags & Fthrid) {
-				n = snprintf(p->buf + p->len, N - p->len, "[%ld] ", (long)pthread_self());
-				if (n > 0 && n < N - p->len)
-					p->len += n;
+			if (f & Fthrnm && !p->threadName.empty()) {
+				append(p, "[", 1);
+				append(p, p->threadName.data(), p->threadName.size());
+				append(p, "] ", 2);
 			}
 
-			if (flags & Fthrnm && !p->threadName.empty()) {
-				n = snprintf(p->buf + p->len, N - p->len, "[%s] ", p->threadName.c_str());
-				if (n > 0 && n < N - p->len)
-					p->len += n;
+			if (f & Flevel && lvname != NULL) {
+				append(p, "[", 1);
+				append(p, lvname, strlen(lvname));
+				append(p, "] ", 2);
 			}
 
-			if (flags & Flevel && lvname != NULL) {
-				n = snprintf(p->buf + p->len, N - p->len, "[%s] ", lvname);
-				if (n > 0 && n < N - p->len)
-					p->len += n;
+			if (!name.empty()) {
+				append(p, "[", 1);
+				append(p, name.data(), name.size());
+				append(p, "] ", 2);
 			}
 		}
 
-		ssize_t logwrite(int logfd, Buffer* p) {
-			ssize_t n = write(logfd, p->buf, p->len);
+		void logwrite(Buffer* p, int lv, uint64_t ts = 0) {
+			SMP_STAT_ADD(Culoglines, 1);
+			SMP_STAT_ADD(Culogbytes, p->len);
+
+			Async* a = __atomic_load_n(&root->async, __ATOMIC_ACQUIRE);
+			if (a == NULL || !push(a, p->buf, p->len, lv, ts))
+				output(lv, p->buf, p->len);
+
 			p->len = 0;
+		}
 
-			return n;
+	private:
+		// 环中的一条日志, 按8字节对齐, len为Wrap表示跳到环的开头
+		struct Rec {
+			uint32_t	len;
+			uint32_t	level;
+			uint64_t	ts;
+			Ulog*		src;		// 写出时按它当时的输出表路由
+		};
+
+		static const uint32_t Wrap = 0xffffffff;
+
+		// 单生产者单消费者的字节环, head和tail只增不减
+		struct Ring {
+			char*		buf;
+			size_t		cap;
+			uint64_t	head;		// 线程写入的位置
+			uint64_t	tail;		// 后台线程写出的位置
+			int		closed;		// 线程已退出, 写完后释放
+		};
+
+		// 后台线程发往同一输出的一批日志
+		struct Batch {
+			const Route*	route;		// 输出表中的项, 写出期间输出表不会被释放
+			int		cnt;
+			struct iovec	iov[IOV_MAX];
+		};
+
+		struct Async {
+			Async(): cap(0), policy(Pblock), stop(false), sleeping(0), blocked(0), flushReq(0), flushDone(0),
+					dropped(0), reported(0) {
+				pthread_mutex_init(&lock, NULL);
+				pthread_cond_init(&wake, NULL);
+				pthread_cond_init(&done, NULL);
+				pthread_cond_init(&room, NULL);
+			}
+
+			~Async() {
+				for (size_t i = 0; i < rings.size(); i++) {
+					::free(rings[i]->buf);
+					delete rings[i];
+				}
+
+				for (size_t i = 0; i < batches.size(); i++)
+					delete batches[i];
+
+				pthread_mutex_destroy(&lock);
+				pthread_cond_destroy(&wake);
+				pthread_cond_destroy(&done);
+				pthread_cond_destroy(&room);
+			}
+
+			size_t		cap;
+			int		policy;
+			pthread_key_t	key;
+			pthread_t	tid;
+
+			pthread_mutex_t	lock;		// 保护rings, stop, blocked和flush计数
+			pthread_cond_t	wake;
+			pthread_cond_t	done;
+			pthread_cond_t	room;		// 后台线程推进tail后广播, Pblock下环满的写入者在此等待
+			std::vector<Ring*> rings;
+			bool		stop;
+			int		sleeping;
+			int		blocked;	// 等待room的写入者数
+			unsigned long	flushReq;
+			unsigned long	flushDone;
+			unsigned long	dropped;
+			unsigned long	reported;
+
+			std::vector<Batch*> batches;	// 只由后台线程使用
+		};
+
+		static size_t align8(size_t n) {
+			return (n + 7) & ~(size_t)7;
+		}
+
+		// 环中记录按此排序, 二进制日志直接复用作为记录时间
+		static uint64_t now() {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+
+		// 当前线程的环, 第一次使用时创建并登记
+		Ring* attach(Async* a) {
+			Ring* r = (Ring*)pthread_getspecific(a->key);
+			if (r != NULL)
+				return r;
+
+			try {
+				r = new Ring();
+			} catch (const std::bad_alloc& e) {
+				return NULL;
+			}
+
+			r->buf = (char*)::malloc(a->cap);
+			r->cap = a->cap;
+			r->head = 0;
+			r->tail = 0;
+			r->closed = 0;
+
+			pthread_mutex_lock(&a->lock);
+			bool ok = r->buf != NULL;
+			if (ok) {
+				try {
+					a->rings.push_back(r);
+				} catch (const std::bad_alloc& e) {
+					ok = false;
+				}
+			}
+			pthread_mutex_unlock(&a->lock);
+
+			if (!ok) {
+				::free(r->buf);
+				delete r;
+				return NULL;
+			}
+
+			pthread_setspecific(a->key, r);
+			return r;
+		}
+
+		static void detach(void* arg) {
+			Ring* r = (Ring*)arg;
+			__atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+		}
+
+		// 追加到当前线程的环, 返回false时由调用者同步写出
+		bool push(Async* a, const char* data, size_t len, int lv, uint64_t ts) {
+			Ring* r = attach(a);
+			if (r == NULL)
+				return false;
+
+			size_t need = align8(sizeof(Rec) + len);
+			if (need > r->cap / 2)
+				return false;
+
+			while (true) {
+				uint64_t head = r->head;
+				uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+				bool empty = head == tail;
+				size_t pos = head & (r->cap - 1);
+				size_t contig = r->cap - pos;
+				size_t total = need <= contig ? need : contig + need;
+
+				if (r->cap - (head - tail) >= total) {
+					if (need > contig) {
+						((Rec*)(r->buf + pos))->len = Wrap;
+						head += contig;
+						pos = 0;
+					}
+
+					Rec* rec = (Rec*)(r->buf + pos);
+					rec->len = (uint32_t)len;
+					rec->level = (uint32_t)lv;
+					rec->ts = ts != 0 ? ts : now();
+					rec->src = this;
+					memcpy(rec + 1, data, len);
+
+					__atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+
+					// 后台线程睡眠时, 环由空变为非空或积压超过1/8才唤醒, 连续写入时不必每条一次futex
+					if ((empty || head + need - tail >= r->cap / 8) && __atomic_load_n(&a->sleeping, __ATOMIC_RELAXED)
+							&& __atomic_exchange_n(&a->sleeping, 0, __ATOMIC_RELAXED))
+						wakeup(a);
+
+					return true;
+				}
+
+				if (a->policy == Pdrop) {
+					__atomic_add_fetch(&a->dropped, 1, __ATOMIC_RELAXED);
+					SMP_STAT_ADD(Culogdrop, 1);
+					return true;
+				}
+
+				if (a->policy == Pspill)
+					return false;
+
+				// 在锁内再确认一次环满, 后台线程推进tail后持锁广播, 不会错过
+				pthread_mutex_lock(&a->lock);
+				pthread_cond_signal(&a->wake);
+				if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == tail) {
+					a->blocked++;
+					pthread_cond_wait(&a->room, &a->lock);
+					a->blocked--;
+				}
+				pthread_mutex_unlock(&a->lock);
+			}
+		}
+
+		static void wakeup(Async* a) {
+			pthread_mutex_lock(&a->lock);
+			pthread_cond_signal(&a->wake);
+			pthread_mutex_unlock(&a->lock);
+		}
+
+		// 同步写到所有接收lv的输出
+		void output(int lv, const char* data, size_t len) {
+			unsigned id = enter();
+
+			const Routes* rt = current();
+			for (size_t i = 0; rt != NULL && i < rt->n; i++) {
+				if (lv < rt->r[i].level)
+					continue;
+
+				struct iovec v;
+				v.iov_base = (void*)data;
+				v.iov_len = len;
+				writeAll(rt->r[i], &v, 1);
+				if (__atomic_load_n(&root->bin, __ATOMIC_RELAXED))
+					renew(rt->r[i]);
+			}
+
+			leave(id);
+		}
+
+		static ssize_t output(const Route& r, const struct iovec* iov, int cnt) {
+			if (r.sink != NULL)
+				return r.sink->writev(iov, cnt);
+
+			return ::writev(r.fd, iov, cnt);
+		}
+
+		// 写出iov中的全部内容, 处理部分写入, 调用者已经enter()
+		static void writeAll(const Route& r, struct iovec* iov, int cnt) {
+			while (cnt > 0) {
+				ssize_t n = output(r, iov, cnt);
+
+				// Fsink不接受超过一个分段的批量, 逐条写出
+				if (n < 0 && errno == EMSGSIZE && cnt > 1)
+					n = output(r, iov, 1);
+
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					break;
+				}
+
+				while (cnt > 0 && (size_t)n >= iov->iov_len) {
+					n -= iov->iov_len;
+					iov++;
+					cnt--;
+				}
+
+				if (cnt > 0) {
+					iov->iov_base = (char*)iov->iov_base + n;
+					iov->iov_len -= n;
+				}
+			}
+		}
+
+		// 发往route的批, 没有时占用一个新的
+		static Batch* batch(Async* a, size_t& nb, const Route& route) {
+			for (size_t i = 0; i < nb; i++) {
+				Batch* b = a->batches[i];
+				if (b->route->sink == route.sink && b->route->fd == route.fd)
+					return b;
+			}
+
+			if (nb == a->batches.size()) {
+				try {
+					a->batches.reserve(nb + 1);
+					a->batches.push_back(new Batch());
+				} catch (const std::bad_alloc& e) {
+					return NULL;
+				}
+			}
+
+			Batch* b = a->batches[nb++];
+			b->route = &route;
+			b->cnt = 0;
+			return b;
+		}
+
+		// 按时间戳合并所有环中已写入的日志, 按记录来源当时的输出表分发到各输出的批,
+		// 某一批满IOV_MAX条时全部写出, 返回写出的条数
+		size_t drain(Async* a, std::vector<Ring*>& rs) {
+			size_t k = rs.size();
+			std::vector<uint64_t> head(k);
+			std::vector<uint64_t> cur(k);
+			size_t nb = 0;
+			size_t total = 0;
+
+			for (size_t i = 0; i < k; i++) {
+				head[i] = __atomic_load_n(&rs[i]->head, __ATOMIC_ACQUIRE);
+				cur[i] = rs[i]->tail;
+			}
+
+			bool bin = __atomic_load_n(&root->bin, __ATOMIC_RELAXED) != 0;
+			unsigned id = enter();
+			while (true) {
+				int best = -1;
+				uint64_t bts = 0;
+
+				for (size_t i = 0; i < k; i++) {
+					Ring* r = rs[i];
+					while (cur[i] < head[i]) {
+						size_t pos = cur[i] & (r->cap - 1);
+						if (((Rec*)(r->buf + pos))->len != Wrap)
+							break;
+						cur[i] += r->cap - pos;
+					}
+
+					if (cur[i] < head[i]) {
+						Rec* rec = (Rec*)(r->buf + (cur[i] & (r->cap - 1)));
+						if (best < 0 || rec->ts < bts) {
+							best = (int)i;
+							bts = rec->ts;
+						}
+					}
+				}
+
+				if (best < 0)
+					break;
+
+				Ring* r = rs[best];
+				Rec* rec = (Rec*)(r->buf + (cur[best] & (r->cap - 1)));
+				const Routes* rt = rec->src->current();
+				bool full = false;
+
+				for (size_t i = 0; rt != NULL && i < rt->n; i++) {
+					if ((int)rec->level < rt->r[i].level)
+						continue;
+
+					Batch* b = batch(a, nb, rt->r[i]);
+					if (b == NULL)
+						continue;
+
+					b->iov[b->cnt].iov_base = rec + 1;
+					b->iov[b->cnt].iov_len = rec->len;
+					if (++b->cnt == IOV_MAX)
+						full = true;
+				}
+
+				total++;
+				cur[best] += align8(sizeof(Rec) + rec->len);
+
+				if (full) {
+					flushBatches(a, nb, bin);
+					for (size_t i = 0; i < k; i++)
+						__atomic_store_n(&rs[i]->tail, cur[i], __ATOMIC_RELEASE);
+
+					// 让出阶段, 使修改输出表的一方不必等到整个合并结束
+					leave(id);
+					id = enter();
+				}
+			}
+
+			flushBatches(a, nb, bin);
+			leave(id);
+
+			// 包括末尾的Wrap
+			for (size_t i = 0; i < k; i++)
+				__atomic_store_n(&rs[i]->tail, cur[i], __ATOMIC_RELEASE);
+
+			return total;
+		}
+
+		static void flushBatches(Async* a, size_t& nb, bool bin) {
+			for (size_t i = 0; i < nb; i++) {
+				Batch* b = a->batches[i];
+				writeAll(*b->route, b->iov, b->cnt);
+				if (bin)
+					renew(*b->route);
+			}
+
+			nb = 0;
+		}
+
+		static void* writer(void* arg) {
+			Ulog* log = (Ulog*)arg;
+			Async* a = NULL;
+			std::vector<Ring*> rs;
+
+			// 等待setAsync发布
+			while ((a = __atomic_load_n(&log->async, __ATOMIC_ACQUIRE)) == NULL)
+				sched_yield();
+
+			while (true) {
+				pthread_mutex_lock(&a->lock);
+				unsigned long req = a->flushReq;
+				bool stop = a->stop;
+				rs = a->rings;
+				pthread_mutex_unlock(&a->lock);
+
+				size_t n = log->drain(a, rs);
+
+				unsigned long d = __atomic_load_n(&a->dropped, __ATOMIC_RELAXED);
+				if (d != a->reported) {
+					char b[64];
+					int len = snprintf(b, sizeof(b), "ulog: %lu lines dropped\n", d - a->reported);
+					log->output(Lwarn, b, len);
+					a->reported = d;
+				}
+
+				pthread_mutex_lock(&a->lock);
+				a->flushDone = req;
+				pthread_cond_broadcast(&a->done);
+				if (a->blocked != 0)
+					pthread_cond_broadcast(&a->room);
+
+				// 释放已退出线程的空环
+				size_t j = 0;
+				for (size_t i = 0; i < a->rings.size(); i++) {
+					Ring* r = a->rings[i];
+					if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)
+							&& r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+						::free(r->buf);
+						delete r;
+					} else {
+						a->rings[j++] = r;
+					}
+				}
+				a->rings.resize(j);
+
+				if (stop && n == 0) {
+					pthread_mutex_unlock(&a->lock);
+					break;
+				}
+
+				if (n == 0 && !a->stop && a->flushReq == req) {
+					struct timespec ts;
+					clock_gettime(CLOCK_REALTIME, &ts);
+					ts.tv_nsec += 10000000;
+					if (ts.tv_nsec >= 1000000000) {
+						ts.tv_sec++;
+						ts.tv_nsec -= 1000000000;
+					}
+
+					__atomic_store_n(&a->sleeping, 1, __ATOMIC_RELAXED);
+					pthread_cond_timedwait(&a->wake, &a->lock, &ts);
+					__atomic_store_n(&a->sleeping, 0, __ATOMIC_RELAXED);
+				}
+				pthread_mutex_unlock(&a->lock);
+			}
+
+			return NULL;
+		}
+
+		// 写完所有环后停止后台线程
+		void stopAsync() {
+			Async* a = __atomic_load_n(&async, __ATOMIC_ACQUIRE);
+			if (a == NULL)
+				return;
+
+			pthread_mutex_lock(&a->lock);
+			a->stop = true;
+			pthread_cond_signal(&a->wake);
+			pthread_mutex_unlock(&a->lock);
+			pthread_join(a->tid, NULL);
+
+			__atomic_store_n(&async, (Async*)NULL, __ATOMIC_RELEASE);
+			pthread_key_delete(a->key);
+			delete a;
 		}
 
 		void loglonger(const char *format, va_list args) {
@@ -265,17 +1344,12 @@ namespace smp {
 			if (!p->longer)
 				return;
 
-			pthread_rwlock_rdlock(&lock);
-			if (p->longer_level < level) {
-				pthread_rwlock_unlock(&lock);
+			if (!enabled(p->longer_level))
 				return;
-			}
 
 			n = vsnprintf(p->buf + p->len, N - p->len, format, args);
 			if (n > 0 && n < N - p->len)
 				p->len += n;
-
-			pthread_rwlock_unlock(&lock);
 		}
 
 		void logshorter(int lv, const char* format, va_list args) {
@@ -291,23 +1365,194 @@ namespace smp {
 				return;
 			}
 
-			pthread_rwlock_rdlock(&lock);
-			if (lv < level) {
-				pthread_rwlock_unlock(&lock);
-				return;
-			}
-
 			logprefix(p, levelNames[lv]);
 
 			n = vsnprintf(p->buf + p->len, N - p->len, format, args);
 			if (n > 0 && n < N - p->len)
 				p->len += n;
 
-			logwrite(logfd, p);
-			pthread_rwlock_unlock(&lock);
+			logwrite(p, lv);
+		}
+
+	private:
+		// 由printf格式串得到参数签名, %n不支持, 按指针处理
+		static std::string signature(const char* fmt) {
+			std::string sig;
+
+			for (const char* c = fmt; *c != '\0'; c++) {
+				if (*c != '%')
+					continue;
+				if (*++c == '%')
+					continue;
+
+				while (*c != '\0' && strchr("-+ #0'", *c) != NULL)
+					c++;
+				if (*c == '*') {
+					sig += 'i';
+					c++;
+				}
+				while (*c >= '0' && *c <= '9')
+					c++;
+				if (*c == '.') {
+					c++;
+					if (*c == '*') {
+						sig += 'i';
+						c++;
+					}
+					while (*c >= '0' && *c <= '9')
+						c++;
+				}
+
+				int longs = 0;
+				bool ld = false;
+				while (*c != '\0' && strchr("hlLqjzt", *c) != NULL) {
+					if (*c == 'l' || *c == 'z' || *c == 't')
+						longs++;
+					else if (*c == 'q' || *c == 'j')
+						longs = 2;
+					else if (*c == 'L')
+						ld = true;
+					c++;
+				}
+
+				switch (*c) {
+				case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+					sig += longs == 0 ? 'i' : (longs == 1 ? 'l' : 'q');
+					break;
+				case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+					sig += ld ? 'D' : 'd';
+					break;
+				case 's':
+					sig += 's';
+					break;
+				case 'p': case 'n':
+					sig += 'p';
+					break;
+				case '\0':
+					return sig;
+				}
+			}
+
+			return sig;
+		}
+
+		static size_t argSize(char c) {
+			switch (c) {
+			case 'i': return sizeof(int);
+			case 'l': return sizeof(long);
+			case 'q': return sizeof(long long);
+			case 'd': return sizeof(double);
+			case 'D': return sizeof(long double);
+			case 'p': return sizeof(void*);
+			case 's': return sizeof(uint32_t);
+			}
+
+			return 0;
+		}
+
+		// 由时间、进程号和地址混合出非0的会话号
+		static uint32_t newSession() {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+
+			uint64_t z = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			z ^= (uint64_t)getpid() << 32 ^ (uint64_t)(uintptr_t)&sites;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			z ^= z >> 31;
+
+			uint32_t id = (uint32_t)(z ^ (z >> 32));
+			return id != 0 ? id : 1;
+		}
+
+		// 写出尚未在本Ulog中出现过的调用点的格式记录
+		void announce(Buffer* p) {
+			std::vector<const Site*> todo;
+
+			// 只在锁内取出待写的调用点, 写出可能阻塞, 而后台线程补写格式记录时也要取这把锁
+			pthread_mutex_lock(&siteLock);
+			uint32_t total = sites != NULL ? (uint32_t)sites->size() : 0;
+			for (uint32_t i = announced; i < total; i++)
+				todo.push_back((*sites)[i]);
+			__atomic_store_n(&announced, total, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&siteLock);
+
+			for (size_t i = 0; i < todo.size(); i++) {
+				size_t n = record(todo[i], p->buf);
+				if (n == 0)
+					continue;
+
+				p->len = n;
+				logwrite(p, todo[i]->level);
+			}
+		}
+
+		// 在d中生成调用点s的格式记录, 返回长度, 超过N时返回0
+		static size_t record(const Site* s, char* d) {
+			size_t n = sizeof(Ubin) + sizeof(uint32_t) + s->sig.size() + s->file.size() + s->fmt.size() + 3;
+			if (n > N)
+				return 0;
+
+			Ubin* h = (Ubin*)d;
+			h->len = (uint32_t)n;
+			h->magic = Ubin::Magic;
+			h->kind = Ubin::Kfmt;
+			h->level = (uint8_t)s->level;
+			h->id = s->id;
+			h->session = s->session;
+			h->ts = 0;
+
+			d += sizeof(Ubin);
+			uint32_t line = (uint32_t)s->line;
+			memcpy(d, &line, sizeof(line));
+			d += sizeof(line);
+			memcpy(d, s->sig.c_str(), s->sig.size() + 1);
+			d += s->sig.size() + 1;
+			memcpy(d, s->file.c_str(), s->file.size() + 1);
+			d += s->file.size() + 1;
+			memcpy(d, s->fmt.c_str(), s->fmt.size() + 1);
+
+			return n;
+		}
+
+		// 向输出r写出所有已登记调用点的格式记录, 用于新接入的输出或分段文件的新段
+		static void describe(const Route& r) {
+			std::vector<const Site*> all;
+
+			pthread_mutex_lock(&siteLock);
+			if (sites != NULL)
+				all.assign(sites->begin(), sites->end());
+			pthread_mutex_unlock(&siteLock);
+
+			std::vector<char> buf(N);
+			for (size_t i = 0; i < all.size(); i++) {
+				struct iovec v;
+				v.iov_base = &buf[0];
+				v.iov_len = record(all[i], &buf[0]);
+				if (v.iov_len != 0)
+					writeAll(r, &v, 1);
+			}
+		}
+
+		// sink换了新文件时补写一次格式记录, 并发的写入者中只有一个会写
+		static void renew(const Route& r) {
+			if (r.sink == NULL)
+				return;
+
+			unsigned long g = r.sink->generation();
+			unsigned long old = __atomic_load_n(&r.gen, __ATOMIC_ACQUIRE);
+			if (g == old)
+				return;
+
+			if (__atomic_compare_exchange_n(&r.gen, &old, g, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				describe(r);
 		}
 
 	private:
+		static std::vector<Site*>* sites;	// 所有调用点, 只增不减
+		static uint32_t session;		// 本进程中调用点编号所属的会话
+		static pthread_mutex_t siteLock;
+
 		static pthread_once_t once_create;
 		static pthread_once_t once_delete;
 		static pthread_key_t key;
@@ -328,17 +1573,58 @@ namespace smp {
 		static const char* const levelNames[];
 	};
 
-	template<size_t N>
-	pthread_once_t Ulog<N>::once_create = PTHREAD_ONCE_INIT;
+	template<size_t N, int M>
+	pthread_once_t Ulog<N, M>::once_create = PTHREAD_ONCE_INIT;
+
+	template<size_t N, int M>
+	pthread_once_t Ulog<N, M>::once_delete = PTHREAD_ONCE_INIT;
+
+	template<size_t N, int M>
+	pthread_key_t Ulog<N, M>::key;
 
-	template<size_t N>
-	pthread_once_t Ulog<N>::once_delete = PTHREAD_ONCE_INIT;
+	template<size_t N, int M>
+	std::vector<typename Ulog<N, M>::Site*>* Ulog<N, M>::sites = NULL;
 
-	template<size_t N>
-	pthread_key_t Ulog<N>::key;
+	template<size_t N, int M>
+	uint32_t Ulog<N, M>::session = 0;
 
-	template<size_t N>
-	const char* const Ulog<N>::levelNames[] = {NULL, "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL", NULL};
+	template<size_t N, int M>
+	pthread_mutex_t Ulog<N, M>::siteLock = PTHREAD_MUTEX_INITIALIZER;
+
+	template<size_t N, int M>
+	const char* const Ulog<N, M>::levelNames[] = {NULL, "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL", NULL};
 }
 
+// 级别未启用时不对参数求值, 低于编译期最低级别的调用被整体消除
+// ULOG_DEBUG(log, "cost %d\n", expensive());
+#define ULOG_LOG(log, lv, fn, ...)	do { if ((log).enabled((log).lv)) (log).fn(__VA_ARGS__); } while (0)
+#define ULOG_TRACE(log, ...)		ULOG_LOG(log, Ltrace, trace, __VA_ARGS__)
+#define ULOG_DEBUG(log, ...)		ULOG_LOG(log, Ldebug, debug, __VA_ARGS__)
+#define ULOG_INFO(log, ...)		ULOG_LOG(log, Linfo, info, __VA_ARGS__)
+#define ULOG_WARN(log, ...)		ULOG_LOG(log, Lwarn, warn, __VA_ARGS__)
+#define ULOG_ERROR(log, ...)		ULOG_LOG(log, Lerror, error, __VA_ARGS__)
+#define ULOG_FATAL(log, ...)		ULOG_LOG(log, Lfatal, fatal, __VA_ARGS__)
+
+// 限流: 每个调用点每ms毫秒最多输出n条, 恢复输出时补一行被抑制的条数
+// ULOG_LIMIT(log, Lerror, 10, 1000, "recv failed: %s\n", strerror(errno));
+#define ULOG_LIMIT(log, lv, n, ms, ...)	do { if ((log).enabled((log).lv)) { \
+						static smp::Ulimit ulog_limit_; \
+						long ulog_sup_ = ulog_limit_.take(n, ms); \
+						if (ulog_sup_ >= 0) { \
+							if (ulog_sup_ > 0) \
+								(log).message((log).lv, "(%ld similar lines suppressed at %s:%d)\n", \
+										ulog_sup_, __FILE__, __LINE__); \
+							(log).message((log).lv, __VA_ARGS__); } } } while (0)
+
+// 采样: 每个调用点每k次输出1次
+#define ULOG_SAMPLE(log, lv, k, ...)	do { if ((log).enabled((log).lv)) { \
+						static smp::Ulimit ulog_limit_; \
+						if (ulog_limit_.sample(k)) (log).message((log).lv, __VA_ARGS__); } } while (0)
+
+// 二进制日志, 调用点第一次执行时登记格式串
+// ULOG_BIN(log, Linfo, "order %ld filled at %.2f\n", id, price);
+#define ULOG_BIN(log, lv, fmt, ...)	do { if ((log).enabled((log).lv)) { \
+						static const void* ulog_site_ = (log).bind((log).lv, fmt, __FILE__, __LINE__); \
+						(log).binary((log).site(ulog_site_), ##__VA_ARGS__); } } while (0)
+
 #endif